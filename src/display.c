@@ -46,6 +46,10 @@
 #include "session.h"
 #include "scan.h"
 
+/* A change within this many pixels of the side of a tile is considered
+   to touch that edge, and so is likely to spill into the neighbor */
+#define TILE_FUZZ                   4
+
 
 static xcb_screen_t *screen_of_display(xcb_connection_t *c, int screen)
 {
@@ -98,6 +102,8 @@ static void handle_cursor_notify(display_t *display,
     if (!ir)
         return;
 
+    scanner_set_pointer(&display->session->scanner, ir->x, ir->y);
+
     imglen = xcb_xfixes_get_cursor_image_cursor_image_length(ir);
     imgdata = xcb_xfixes_get_cursor_image_cursor_image(ir);
 
@@ -141,6 +147,116 @@ static void handle_damage_notify(display_t *display, xcb_damage_notify_event_t *
     pixman_region_clear(damage_region);
 }
 
+/*----------------------------------------------------------------------------
+**  Top level windows
+**      We follow the geometry of each child of the root window, so that
+**  when one moves we can have the client copy its pixels to the new spot
+**  instead of sending them all again.  The table is only touched from the
+**  event thread (and from display_open, before that thread starts).
+**--------------------------------------------------------------------------*/
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+    int mapped;
+} window_geometry_t;
+
+static window_geometry_t *find_window(display_t *d, xcb_window_t window, int create)
+{
+    window_geometry_t *g;
+
+    g = g_hash_table_lookup(d->windows, GUINT_TO_POINTER(window));
+    if (!g && create) {
+        g = calloc(1, sizeof(*g));
+        if (g)
+            g_hash_table_insert(d->windows, GUINT_TO_POINTER(window), g);
+    }
+
+    return g;
+}
+
+static void track_top_level_windows(display_t *d)
+{
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    xcb_get_window_attributes_cookie_t *attr_cookies;
+    xcb_get_geometry_cookie_t *geo_cookies;
+    int count;
+    int i;
+
+    d->windows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+
+    tree = xcb_query_tree_reply(d->c, xcb_query_tree(d->c, d->root), NULL);
+    if (!tree)
+        return;
+
+    children = xcb_query_tree_children(tree);
+    count = xcb_query_tree_children_length(tree);
+    attr_cookies = calloc(count, sizeof(*attr_cookies));
+    geo_cookies = calloc(count, sizeof(*geo_cookies));
+
+    for (i = 0; attr_cookies && geo_cookies && i < count; i++) {
+        attr_cookies[i] = xcb_get_window_attributes(d->c, children[i]);
+        geo_cookies[i] = xcb_get_geometry(d->c, children[i]);
+    }
+
+    for (i = 0; attr_cookies && geo_cookies && i < count; i++) {
+        xcb_get_window_attributes_reply_t *attr;
+        xcb_get_geometry_reply_t *geo;
+        window_geometry_t *g;
+
+        attr = xcb_get_window_attributes_reply(d->c, attr_cookies[i], NULL);
+        geo = xcb_get_geometry_reply(d->c, geo_cookies[i], NULL);
+        if (attr && geo && (g = find_window(d, children[i], TRUE))) {
+            g->x = geo->x;
+            g->y = geo->y;
+            g->w = geo->width + 2 * geo->border_width;
+            g->h = geo->height + 2 * geo->border_width;
+            g->mapped = attr->map_state == XCB_MAP_STATE_VIEWABLE;
+        }
+        free(attr);
+        free(geo);
+    }
+
+    free(attr_cookies);
+    free(geo_cookies);
+    free(tree);
+}
+
+/*----------------------------------------------------------------------------
+**  A visible window that moved without changing size is handed to the
+**  scanner as a move.  Anything the copy gets wrong (say, another window
+**  lies on top of the one that moved) is caught when the scanner checks
+**  the destination against the screen.
+**--------------------------------------------------------------------------*/
+static void handle_window_configure(display_t *display, xcb_configure_notify_event_t *cev)
+{
+    window_geometry_t *g;
+    int w = cev->width + 2 * cev->border_width;
+    int h = cev->height + 2 * cev->border_width;
+
+    g = find_window(display, cev->window, TRUE);
+    if (!g)
+        return;
+
+    if (g->mapped && g->w == w && g->h == h && (g->x != cev->x || g->y != cev->y))
+        scanner_push_move(&display->session->scanner, cev->x, cev->y, w, h,
+                          cev->x - g->x, cev->y - g->y);
+
+    g->x = cev->x;
+    g->y = cev->y;
+    g->w = w;
+    g->h = h;
+}
+
+static void handle_window_map_state(display_t *display, xcb_window_t window, int mapped)
+{
+    window_geometry_t *g = find_window(display, window, TRUE);
+    if (g)
+        g->mapped = mapped;
+}
+
 static void handle_configure_notify(display_t *display, xcb_configure_notify_event_t *cev)
 {
 #if defined(DEBUG_DISPLAY_EVENTS)
@@ -151,7 +267,8 @@ static void handle_configure_notify(display_t *display, xcb_configure_notify_eve
 #endif
 
     if (cev->window != display->root) {
-        g_debug("not main window; skipping.");
+        if (cev->event == display->root)
+            handle_window_configure(display, cev);
         return;
     }
 
@@ -178,7 +295,25 @@ static void *handle_xevents(void *opaque)
         else if (ev->response_type == XCB_CONFIGURE_NOTIFY)
             handle_configure_notify(display, (xcb_configure_notify_event_t *) ev);
 
-        else
+        else if (ev->response_type == XCB_MAP_NOTIFY)
+            handle_window_map_state(display, ((xcb_map_notify_event_t *) ev)->window, TRUE);
+
+        else if (ev->response_type == XCB_UNMAP_NOTIFY)
+            handle_window_map_state(display, ((xcb_unmap_notify_event_t *) ev)->window, FALSE);
+
+        else if (ev->response_type == XCB_DESTROY_NOTIFY)
+            g_hash_table_remove(display->windows,
+                                GUINT_TO_POINTER(((xcb_destroy_notify_event_t *) ev)->window));
+
+        else if (ev->response_type == XCB_REPARENT_NOTIFY) {
+            xcb_reparent_notify_event_t *rev = (xcb_reparent_notify_event_t *) ev;
+            if (rev->parent != display->root)
+                g_hash_table_remove(display->windows, GUINT_TO_POINTER(rev->window));
+        }
+
+        else if (ev->response_type != XCB_CREATE_NOTIFY &&
+                 ev->response_type != XCB_GRAVITY_NOTIFY &&
+                 ev->response_type != XCB_CIRCULATE_NOTIFY)
             g_debug("Unexpected X event %d", ev->response_type);
 
         free(ev);
@@ -197,7 +332,7 @@ static void *handle_xevents(void *opaque)
 
 static int register_for_events(display_t *d)
 {
-    uint32_t events = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    uint32_t events = XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
     xcb_void_cookie_t cookie;
     xcb_generic_error_t *error;
 
@@ -210,6 +345,8 @@ static int register_for_events(display_t *d)
         return X11SPICE_ERR_NOEVENTS;
     }
 
+    track_top_level_windows(d);
+
     return 0;
 }
 
@@ -228,6 +365,10 @@ int display_open(display_t *d, session_t *session)
     xcb_screen_t *screen;
 
     d->session = session;
+    d->windows = NULL;
+    d->returned = NULL;
+    d->shm_cache_count = 0;
+    d->shm_cache_bytes = 0;
 
     d->c = xcb_connect(session->options.display, &scr);
     if (!d->c || xcb_connection_has_error(d->c)) {
@@ -321,40 +462,110 @@ int display_open(display_t *d, session_t *session)
     return rc;
 }
 
-/* 
-  TODO: Implement a cache for shared memory handles
-        That is, instead of doing the shmget/shmat for every read,
-        we should cache the shmid, and reuse if we're doing a later
-        read of a similar size.
+/*----------------------------------------------------------------------------
+**  Shared memory cache
+**      Setting up a segment (shmget, shmat, and a round trip to attach it
+**  to the X server) costs far more than the read that uses it.  So images
+**  spice is done with are kept and reused for later reads of a smaller or
+**  equal size.  Spice hands images back on its worker thread, where we
+**  want no X traffic at all; display_return_shm_image just pushes them on
+**  a lock free stack, and the scanner thread, which owns the cache, takes
+**  them off in batches with display_reclaim_shm_images.
+**--------------------------------------------------------------------------*/
+static shm_image_t *shm_cache_take(display_t *d, int imgsize)
+{
+    shm_image_t *shmi;
+    int best = -1;
+    int i;
 
-        We would likely see a 40% improvement in raw read time.  Note
-        that a callgrind run suggested that would be on the order of 5%
-        overall.
-*/
+    for (i = 0; i < d->shm_cache_count; i++)
+        if (d->shm_cache[i]->size >= imgsize &&
+            (best < 0 || d->shm_cache[i]->size < d->shm_cache[best]->size))
+            best = i;
+
+    if (best < 0)
+        return NULL;
+
+    shmi = d->shm_cache[best];
+    d->shm_cache[best] = d->shm_cache[--d->shm_cache_count];
+    d->shm_cache_bytes -= shmi->size;
+    return shmi;
+}
+
+void display_return_shm_image(display_t *d, shm_image_t *shmi)
+{
+    do
+        shmi->next = g_atomic_pointer_get(&d->returned);
+    while (!g_atomic_pointer_compare_and_exchange(&d->returned, shmi->next, shmi));
+}
+
+void display_reclaim_shm_images(display_t *d)
+{
+    shm_image_t *shmi;
+    shm_image_t *next;
+
+    do
+        shmi = g_atomic_pointer_get(&d->returned);
+    while (shmi && !g_atomic_pointer_compare_and_exchange(&d->returned, shmi, NULL));
+
+    for (; shmi; shmi = next) {
+        next = shmi->next;
+
+        if (d->shm_cache_count < SHM_CACHE_SIZE &&
+            d->shm_cache_bytes + shmi->size <= SHM_CACHE_BYTES) {
+            d->shm_cache[d->shm_cache_count++] = shmi;
+            d->shm_cache_bytes += shmi->size;
+        }
+        else
+            destroy_shm_image(d, shmi);
+    }
+}
+
+static void shm_cache_flush(display_t *d)
+{
+    display_reclaim_shm_images(d);
+    while (d->shm_cache_count > 0)
+        destroy_shm_image(d, d->shm_cache[--d->shm_cache_count]);
+    d->shm_cache_bytes = 0;
+}
 
 shm_image_t *create_shm_image(display_t *d, int w, int h)
 {
     shm_image_t *shmi;
     int imgsize;
+    int bytes_per_line;
     xcb_void_cookie_t cookie;
     xcb_generic_error_t *error;
 
-    shmi = calloc(1, sizeof(*shmi));
+    bytes_per_line = (bits_per_pixel(d) / 8) * (w ? w : d->width);
+    imgsize = bytes_per_line * (h ? h : d->height);
+
+    shmi = shm_cache_take(d, imgsize);
+    if (shmi) {
+        shmi->w = w ? w : d->width;
+        shmi->h = h ? h : d->height;
+        shmi->bytes_per_line = bytes_per_line;
+        shmi->refs = 1;
+        return shmi;
+    }
+
+    shmi = pool_alloc0(&d->session->shmi_pool);
     if (!shmi)
         return shmi;
 
     shmi->w = w ? w : d->width;
     shmi->h = h ? h : d->height;
 
-    shmi->bytes_per_line = (bits_per_pixel(d) / 8) * shmi->w;
-    imgsize = shmi->bytes_per_line * shmi->h;
+    shmi->bytes_per_line = bytes_per_line;
+    shmi->size = imgsize;
+    shmi->refs = 1;
 
     shmi->shmid = shmget(IPC_PRIVATE, imgsize, IPC_CREAT | 0700);
     if (shmi->shmid != -1)
         shmi->shmaddr = shmat(shmi->shmid, 0, 0);
     if (shmi->shmid == -1 || shmi->shmaddr == (void *) -1) {
         g_warning("Cannot get shared memory of size %d; errno %d", imgsize, errno);
-        free(shmi);
+        pool_free(&d->session->shmi_pool, shmi);
         return NULL;
     }
     /* We tell shmctl to detach now; that prevents us from holding this
@@ -412,7 +623,14 @@ int display_find_changed_tiles(display_t *d, int row, int *tiles, int tiles_acro
                 len = d->scanline->w - (i * len);
             if (memcmp(old, new, sizeof(*old) * len)) {
                 ret++;
-                tiles[i]++;
+                tiles[i] = TILE_CHANGED;
+                if (len > TILE_FUZZ) {
+                    if (memcmp(old, new, sizeof(*old) * TILE_FUZZ))
+                        tiles[i] |= TILE_EDGE_LEFT;
+                    if (memcmp(old + len - TILE_FUZZ, new + len - TILE_FUZZ,
+                               sizeof(*old) * TILE_FUZZ))
+                        tiles[i] |= TILE_EDGE_RIGHT;
+                }
             }
         }
     }
@@ -428,6 +646,179 @@ int display_find_changed_tiles(display_t *d, int row, int *tiles, int tiles_acro
     return ret;
 }
 
+static int image_fits_fullscreen(display_t *d, shm_image_t *shmi, int x, int y)
+{
+    return x + shmi->w <= d->fullscreen->w && y + shmi->h <= d->fullscreen->h;
+}
+
+/* Returns 1 if the given row of a captured image differs from the mirror */
+int display_row_changed(display_t *d, shm_image_t *shmi, int x, int y, int row)
+{
+    uint32_t *old = ((uint32_t *) d->fullscreen->shmaddr) + ((y + row) * d->fullscreen->w) + x;
+    uint32_t *new = ((uint32_t *) shmi->shmaddr) + row * shmi->w;
+
+    if (!image_fits_fullscreen(d, shmi, x, y))
+        return 1;
+
+    return memcmp(old, new, sizeof(*old) * shmi->w) != 0;
+}
+
+/*----------------------------------------------------------------------------
+**  Compare rows [top, bottom) of a freshly captured image against the
+**  mirror of the screen.  Returns 0 if nothing changed; otherwise returns 1
+**  and trims the left/top/right/bottom bounds (relative to shmi) to the
+**  pixels that differ.  A capture that no longer fits the mirror is
+**  reported as wholly changed.
+**--------------------------------------------------------------------------*/
+int display_find_changed_area(display_t *d, shm_image_t *shmi, int x, int y,
+                              int *left, int *top, int *right, int *bottom)
+{
+    uint32_t *old = ((uint32_t *) d->fullscreen->shmaddr) + (y * d->fullscreen->w) + x;
+    uint32_t *new = ((uint32_t *) shmi->shmaddr);
+    int i;
+    int l, r;
+
+    *left = 0;
+    *right = shmi->w;
+
+    if (!image_fits_fullscreen(d, shmi, x, y))
+        return 1;
+
+    while (*top < *bottom &&
+           memcmp(old + *top * d->fullscreen->w, new + *top * shmi->w,
+                  sizeof(*old) * shmi->w) == 0)
+        (*top)++;
+    if (*top == *bottom)
+        return 0;
+
+    while (memcmp(old + (*bottom - 1) * d->fullscreen->w, new + (*bottom - 1) * shmi->w,
+                  sizeof(*old) * shmi->w) == 0)
+        (*bottom)--;
+
+    /* Narrow the columns; every row in [top, bottom) may contribute */
+    *left = shmi->w;
+    *right = 0;
+    for (i = *top; i < *bottom; i++) {
+        uint32_t *o = old + i * d->fullscreen->w;
+        uint32_t *n = new + i * shmi->w;
+
+        for (l = 0; l < *left && o[l] == n[l]; l++)
+            ;
+        if (l == shmi->w)
+            continue;
+        if (l < *left)
+            *left = l;
+
+        for (r = shmi->w; r > *right && o[r - 1] == n[r - 1]; r--)
+            ;
+        if (r > *right)
+            *right = r;
+    }
+
+    return 1;
+}
+
+/*----------------------------------------------------------------------------
+**  Scroll detection
+**      When a window scrolls, most rows of the new image are rows of the
+**  mirror shifted by some dy.  We hash every row of both, and let a
+**  sample of the new rows vote for the offsets at which their hash turns
+**  up in the mirror.  The winning offset is then checked row by row; if
+**  enough rows really did just move, the caller can have the client move
+**  them rather than send them again.
+**  Runs of identical rows (blank space, mostly) and rows that did not
+**  change at all say nothing about the offset, so they do not vote.
+**--------------------------------------------------------------------------*/
+#define SCROLL_MIN_ROWS             16
+#define SCROLL_MIN_WIDTH            64
+#define SCROLL_SAMPLE               4
+
+static guint64 hash_row(uint32_t *p, int w)
+{
+    guint64 hash = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < w; i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+
+    return hash;
+}
+
+/* Returns the offset by which the content scrolled, or 0 if it did not */
+int display_find_scroll(display_t *d, shm_image_t *shmi, int x, int y)
+{
+    uint32_t *old = ((uint32_t *) d->fullscreen->shmaddr) + (y * d->fullscreen->w) + x;
+    uint32_t *new = ((uint32_t *) shmi->shmaddr);
+    guint64 *old_hash;
+    guint64 *new_hash;
+    int *votes;
+    int h = shmi->h;
+    int best = 0;
+    int matched = 0;
+    int dy;
+    int i, j;
+
+    if (shmi->w < SCROLL_MIN_WIDTH || h < 2 * SCROLL_MIN_ROWS ||
+        !image_fits_fullscreen(d, shmi, x, y))
+        return 0;
+
+    old_hash = malloc(sizeof(*old_hash) * h);
+    new_hash = malloc(sizeof(*new_hash) * h);
+    votes = calloc(2 * h, sizeof(*votes));
+    if (!old_hash || !new_hash || !votes)
+        h = 0;
+
+    for (i = 0; i < h; i++) {
+        old_hash[i] = hash_row(old + i * d->fullscreen->w, shmi->w);
+        new_hash[i] = hash_row(new + i * shmi->w, shmi->w);
+    }
+
+    for (i = 0; i < h; i += SCROLL_SAMPLE) {
+        if (new_hash[i] == old_hash[i] || (i > 0 && new_hash[i] == new_hash[i - 1]))
+            continue;
+        for (j = 0; j < h; j++)
+            if (old_hash[j] == new_hash[i])
+                votes[i - j + h]++;
+    }
+
+    for (i = 0; i < 2 * h; i++)
+        if (i != h && votes[i] > votes[best])
+            best = i;
+    dy = best - h;
+
+    if (h > 0 && votes[best] > 0)
+        for (i = MAX(0, dy); i < MIN(h, h + dy); i++)
+            if (new_hash[i] == old_hash[i - dy] &&
+                memcmp(new + i * shmi->w, old + (i - dy) * d->fullscreen->w,
+                       sizeof(*new) * shmi->w) == 0)
+                matched++;
+
+    free(old_hash);
+    free(new_hash);
+    free(votes);
+
+    if (matched < SCROLL_MIN_ROWS || matched < (h - ABS(dy)) / 2)
+        return 0;
+
+    return dy;
+}
+
+/* Copy an area of the mirror to another spot, as COPY_BITS will on the
+   client; the two areas may overlap */
+void display_move_area(display_t *d, int src_x, int src_y, int w, int h, int x, int y)
+{
+    uint32_t *from = ((uint32_t *) d->fullscreen->shmaddr) + (src_y * d->fullscreen->w) + src_x;
+    uint32_t *to = ((uint32_t *) d->fullscreen->shmaddr) + (y * d->fullscreen->w) + x;
+    int i;
+
+    if (y > src_y)
+        for (i = h - 1; i >= 0; i--)
+            memmove(to + i * d->fullscreen->w, from + i * d->fullscreen->w, sizeof(*to) * w);
+    else
+        for (i = 0; i < h; i++)
+            memmove(to + i * d->fullscreen->w, from + i * d->fullscreen->w, sizeof(*to) * w);
+}
+
 void display_copy_image_into_fullscreen(display_t *d, shm_image_t *shmi, int x, int y)
 {
     uint32_t *to = ((uint32_t *) d->fullscreen->shmaddr) + (y * d->fullscreen->w) + x;
@@ -454,9 +845,7 @@ void destroy_shm_image(display_t *d, shm_image_t *shmi)
     xcb_shm_detach(d->c, shmi->shmseg);
     shmdt(shmi->shmaddr);
     shmctl(shmi->shmid, IPC_RMID, NULL);
-    if (shmi->drawable_ptr)
-        free(shmi->drawable_ptr);
-    free(shmi);
+    pool_free(&d->session->shmi_pool, shmi);
 }
 
 int display_create_screen_images(display_t *d)
@@ -477,6 +866,8 @@ int display_create_screen_images(display_t *d)
 
 void display_destroy_screen_images(display_t *d)
 {
+    shm_cache_flush(d);
+
     if (d->fullscreen) {
         destroy_shm_image(d, d->fullscreen);
         d->fullscreen = NULL;
@@ -506,4 +897,8 @@ void display_close(display_t *d)
     xcb_damage_destroy(d->c, d->damage);
     display_destroy_screen_images(d);
     xcb_disconnect(d->c);
+
+    if (d->windows)
+        g_hash_table_destroy(d->windows);
+    d->windows = NULL;
 }
@@ -24,21 +24,36 @@
 #include <xcb/xcb.h>
 #include <xcb/damage.h>
 #include <xcb/shm.h>
+#include <glib.h>
 
 
 struct session_struct;
 
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+/* Flags reported for each tile by display_find_changed_tiles */
+#define TILE_CHANGED                0x1
+#define TILE_EDGE_LEFT              0x2
+#define TILE_EDGE_RIGHT             0x4
+
+/* Limits on the shared memory segments we keep around for reuse */
+#define SHM_CACHE_SIZE              32
+#define SHM_CACHE_BYTES             (64 * 1024 * 1024)
+
 /*----------------------------------------------------------------------------
 **  Structure definitions
 **--------------------------------------------------------------------------*/
-typedef struct {
+typedef struct shm_image {
     int shmid;
     int w;
     int h;
     int bytes_per_line;
+    int size;
+    int refs;
     xcb_shm_seg_t shmseg;
     void *shmaddr;
-    void *drawable_ptr;
+    struct shm_image *next;
 } shm_image_t;
 
 typedef struct {
@@ -55,9 +70,16 @@ typedef struct {
 
     const xcb_query_extension_reply_t *xfixes_ext;
 
+    GHashTable *windows;
+
     shm_image_t *fullscreen;
     shm_image_t *scanline;
 
+    void *returned;
+    shm_image_t *shm_cache[SHM_CACHE_SIZE];
+    int shm_cache_count;
+    int shm_cache_bytes;
+
     pthread_t event_thread;
     struct session_struct *session;
 } display_t;
@@ -73,10 +95,17 @@ void display_destroy_screen_images(display_t *d);
 int display_start_event_thread(display_t *d);
 void display_stop_event_thread(display_t *d);
 int display_find_changed_tiles(display_t *d, int row, int *tiles, int tiles_across);
+int display_row_changed(display_t *d, shm_image_t *shmi, int x, int y, int row);
+int display_find_changed_area(display_t *d, shm_image_t *shmi, int x, int y,
+                              int *left, int *top, int *right, int *bottom);
+int display_find_scroll(display_t *d, shm_image_t *shmi, int x, int y);
+void display_move_area(display_t *d, int src_x, int src_y, int w, int h, int x, int y);
 void display_copy_image_into_fullscreen(display_t *d, shm_image_t *shmi, int x, int y);
 
 shm_image_t *create_shm_image(display_t *d, int w, int h);
 int read_shm_image(display_t *d, shm_image_t *shmi, int x, int y);
 void destroy_shm_image(display_t *d, shm_image_t *shmi);
+void display_return_shm_image(display_t *d, shm_image_t *shmi);
+void display_reclaim_shm_images(display_t *d);
 
 #endif
@@ -25,6 +25,7 @@
 
 #include "options.h"
 #include "display.h"
+#include "pool.h"
 
 struct session_struct;
 
@@ -38,6 +39,7 @@ typedef struct {
 
     int width;
     int height;
+    void *primary;
 
     SpiceKbdInstance keyboard_sin;
     uint8_t escape;
@@ -45,17 +47,24 @@ typedef struct {
     SpiceTabletInstance tablet_sin;
     uint32_t buttons_state;
 
-    int compression_level;
+    gint compression_level;
+
+    char *video_codecs;
+    int video_codecs_allowed;
+    gint client_codecs;
+    char *client_video_codecs;
 
     struct session_struct *session;
 } spice_t;
 
-typedef enum { RELEASE_SHMI, RELEASE_MEMORY } release_type_t;
+typedef enum { RELEASE_SHMI, RELEASE_MEMORY, RELEASE_POOL, RELEASE_LOSSY } release_type_t;
 
 typedef struct {
     release_type_t type;
     void *data;
     spice_t *s;
+    pool_t *pool;
+    void *drawable;
 } spice_release_t;
 
 /*----------------------------------------------------------------------------
@@ -63,11 +72,13 @@ typedef struct {
 **--------------------------------------------------------------------------*/
 int spice_start(spice_t *s, options_t *options, shm_image_t *fullscreen);
 void spice_end(spice_t *s);
-int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shmaddr);
+int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line);
 void spice_destroy_primary(spice_t *s);
 
 spice_release_t *spice_create_release(spice_t *s, release_type_t type, void *data);
+spice_release_t *spice_create_pool_release(spice_t *s, pool_t *pool, void *data);
 void spice_free_release(spice_release_t *r);
+void spice_unref_shm_image(spice_t *s, shm_image_t *shmi);
 
 
 #endif
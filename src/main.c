@@ -35,6 +35,7 @@
 #include "local_spice.h"
 #include "display.h"
 #include "agent.h"
+#include "stream.h"
 #include "gui.h"
 #include "session.h"
 
@@ -119,6 +120,13 @@ int main(int argc, char *argv[])
         goto exit;
     spice_started = 1;
     agent_start(&session.spice, &session.options, &session.agent);
+    rc = stream_start(&session.spice, &session.options, &session.stream);
+    if (rc) {
+        gui_report_error(&session.gui,
+                         "Video streaming was requested, but could not be started.\n"
+                         "Check that the GStreamer encoder plugins are installed.");
+        goto exit;
+    }
 
     /*------------------------------------------------------------------------
     **  Start our session and leave the GUI running until we have
@@ -150,6 +158,7 @@ exit:
         session_end(&session);
 
     if (spice_started) {
+        stream_stop(&session.stream);
         agent_stop(&session.agent);
         spice_end(&session.spice);
     }
@@ -68,6 +68,16 @@ void options_free(options_t *options)
     options->on_connect = NULL;
     g_free(options->on_disconnect);
     options->on_disconnect = NULL;
+    g_free(options->image_compression);
+    options->image_compression = NULL;
+    g_free(options->jpeg_wan_compression);
+    options->jpeg_wan_compression = NULL;
+    g_free(options->zlib_glz_wan_compression);
+    options->zlib_glz_wan_compression = NULL;
+    g_free(options->streaming_video);
+    options->streaming_video = NULL;
+    g_free(options->video_codecs);
+    options->video_codecs = NULL;
 
     if (options->listen)
         free(options->listen);
@@ -111,6 +121,22 @@ static gint int_option(GKeyFile *u, GKeyFile *s, const gchar *section, const gch
     return ret;
 }
 
+/* Like int_option, but for settings where 0 is a legitimate value */
+static gboolean has_option(GKeyFile *u, GKeyFile *s, const gchar *section, const gchar *key)
+{
+    return (u && g_key_file_has_key(u, section, key, NULL)) ||
+        (s && g_key_file_has_key(s, section, key, NULL));
+}
+
+static gint int_option_default(GKeyFile *u, GKeyFile *s, const gchar *section, const gchar *key,
+                               gint def)
+{
+    if (has_option(u, s, section, key))
+        return int_option(u, s, section, key);
+
+    return def;
+}
+
 static gboolean bool_option(GKeyFile *u, GKeyFile *s, const gchar *section, const gchar *key)
 {
     gboolean ret = FALSE;
@@ -388,6 +414,21 @@ void options_from_config(options_t *options)
     options->on_disconnect = string_option(userkey, systemkey, "spice", "on-disconnect");
     options->audit = bool_option(userkey, systemkey, "spice", "audit");
     options->audit_message_type = int_option(userkey, systemkey, "spice", "audit-message-type");
+    options->full_screen_threshold = int_option(userkey, systemkey, "spice", "full-screen-threshold");
+    options->max_scan_fps = int_option(userkey, systemkey, "spice", "max-scan-fps");
+    options->stream = bool_option(userkey, systemkey, "spice", "stream");
+    options->stream_max_bitrate = int_option(userkey, systemkey, "spice", "stream-max-bitrate");
+    options->compression_level = int_option_default(userkey, systemkey, "spice", "compression-level",
+                                                    DEFAULT_COMPRESSION_LEVEL);
+    options->compression_level_set = has_option(userkey, systemkey, "spice", "compression-level");
+    options->image_compression = string_option(userkey, systemkey, "spice", "image-compression");
+    options->jpeg_wan_compression = string_option(userkey, systemkey, "spice", "jpeg-wan-compression");
+    options->zlib_glz_wan_compression = string_option(userkey, systemkey, "spice",
+                                                      "zlib-glz-wan-compression");
+    options->streaming_video = string_option(userkey, systemkey, "spice", "streaming-video");
+    options->video_codecs = string_option(userkey, systemkey, "spice", "video-codecs");
+    options->progressive = bool_option(userkey, systemkey, "spice", "progressive");
+    options->refine_delay = int_option(userkey, systemkey, "spice", "refine-delay");
 
 #if defined(HAVE_LIBAUDIT_H)
     /* Pick an arbitrary default in the user range.  CodeWeavers was founed in 1996, so 1196 it is... */
@@ -395,6 +436,23 @@ void options_from_config(options_t *options)
         options->audit_message_type = AUDIT_LAST_USER_MSG - 3;
 #endif
 
+    if (options->full_screen_threshold <= 0)
+        options->full_screen_threshold = DEFAULT_FULL_SCREEN_THRESHOLD;
+    if (options->max_scan_fps <= 0)
+        options->max_scan_fps = DEFAULT_MAX_SCAN_FPS;
+    if (options->stream_max_bitrate <= 0)
+        options->stream_max_bitrate = DEFAULT_STREAM_MAX_BITRATE;
+    if (options->refine_delay <= 0)
+        options->refine_delay = DEFAULT_REFINE_DELAY;
+    if (!options->video_codecs)
+        options->video_codecs = g_strdup(DEFAULT_VIDEO_CODECS);
+    if (options->compression_level < 0 || options->compression_level > MAX_COMPRESSION_LEVEL) {
+        fprintf(stderr, "Error: compression-level must be between 0 and %d; using %d\n",
+                MAX_COMPRESSION_LEVEL, DEFAULT_COMPRESSION_LEVEL);
+        options->compression_level = DEFAULT_COMPRESSION_LEVEL;
+        options->compression_level_set = FALSE;
+    }
+
     options_handle_ssl_file_options(options, userkey, systemkey);
 
     if (systemkey)
@@ -25,6 +25,14 @@
 **  constants
 **--------------------------------------------------------------------------*/
 #define DEFAULT_PASSWORD_LENGTH     8
+#define DEFAULT_FULL_SCREEN_THRESHOLD   50
+#define DEFAULT_MAX_SCAN_FPS            30
+#define DEFAULT_STREAM_MAX_BITRATE      8000
+#define DEFAULT_COMPRESSION_LEVEL       1
+#define MAX_COMPRESSION_LEVEL           2
+#define DEFAULT_REFINE_DELAY            500
+/* Cheapest to encode first; spice uses the first the client decodes */
+#define DEFAULT_VIDEO_CODECS            "spice:mjpeg;gstreamer:mjpeg;gstreamer:h264;gstreamer:vp8;gstreamer:vp9"
 
 /*----------------------------------------------------------------------------
 **  Structure definitions
@@ -62,6 +70,19 @@ typedef struct {
     char *on_disconnect;
     int audit;
     int audit_message_type;
+    int full_screen_threshold;
+    int max_scan_fps;
+    int stream;
+    int stream_max_bitrate;
+    int compression_level;
+    int compression_level_set;
+    char *image_compression;
+    char *jpeg_wan_compression;
+    char *zlib_glz_wan_compression;
+    char *streaming_video;
+    char *video_codecs;
+    int progressive;
+    int refine_delay;
 
     /* file names of config files */
     char *user_config_file;
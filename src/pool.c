@@ -0,0 +1,138 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  pool.c
+**      Free lists for the fixed size objects we allocate for every screen
+**  update.  These are typically allocated on one thread and freed on
+**  another (often the spice worker), so frees never take a lock: they are
+**  pushed onto a lock free 'remote' stack.  An allocation takes the pool
+**  lock, and when the local list runs dry, claims the whole remote stack
+**  in one exchange.  As we only ever push one item or take them all, the
+**  stack is not subject to the ABA problem.
+**
+**  Each object is still an ordinary malloc() block, so memory from a pool
+**  can always be handed to free().
+**--------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+void pool_create(pool_t *pool, const char *name, size_t size, int max_free)
+{
+    pool->name = name;
+    pool->size = MAX(size, sizeof(pool_item_t));
+    pool->max_free = max_free;
+    pool->lock = g_mutex_new();
+    pool->local = NULL;
+    pool->remote = NULL;
+    pool->cached = 0;
+    pool->allocs = 0;
+    pool->hits = 0;
+    pool->live = 0;
+}
+
+static void free_items(pool_item_t *item)
+{
+    pool_item_t *next;
+
+    for (; item; item = next) {
+        next = item->next;
+        free(item);
+    }
+}
+
+/* Note: no other thread may be using the pool */
+void pool_destroy(pool_t *pool)
+{
+    if (!pool->lock)
+        return;
+
+    if (pool->allocs)
+        g_debug("%s pool: %d allocations, %d%% reused, %d still live", pool->name,
+                pool->allocs, pool->hits * 100 / pool->allocs, pool->live);
+
+    free_items(pool->local);
+    free_items(pool->remote);
+    pool->local = NULL;
+    pool->remote = NULL;
+
+    g_mutex_free(pool->lock);
+    pool->lock = NULL;
+}
+
+void *pool_alloc(pool_t *pool)
+{
+    pool_item_t *item;
+
+    g_mutex_lock(pool->lock);
+    if (!pool->local) {
+        do
+            pool->local = g_atomic_pointer_get(&pool->remote);
+        while (pool->local &&
+               !g_atomic_pointer_compare_and_exchange(&pool->remote, pool->local, NULL));
+    }
+    item = pool->local;
+    if (item)
+        pool->local = item->next;
+    g_mutex_unlock(pool->lock);
+
+    g_atomic_int_inc(&pool->allocs);
+    if (item) {
+        g_atomic_int_inc(&pool->hits);
+        g_atomic_int_add(&pool->cached, -1);
+    }
+    else
+        item = malloc(pool->size);
+
+    if (item)
+        g_atomic_int_inc(&pool->live);
+
+    return item;
+}
+
+void *pool_alloc0(pool_t *pool)
+{
+    void *p = pool_alloc(pool);
+    if (p)
+        memset(p, 0, pool->size);
+    return p;
+}
+
+void pool_free(pool_t *pool, void *p)
+{
+    pool_item_t *item = (pool_item_t *) p;
+
+    if (!item)
+        return;
+
+    g_atomic_int_add(&pool->live, -1);
+    if (g_atomic_int_get(&pool->cached) >= pool->max_free) {
+        free(item);
+        return;
+    }
+
+    g_atomic_int_inc(&pool->cached);
+    do
+        item->next = g_atomic_pointer_get(&pool->remote);
+    while (!g_atomic_pointer_compare_and_exchange(&pool->remote, item->next, item));
+}
@@ -0,0 +1,58 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <glib.h>
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct pool_item {
+    struct pool_item *next;
+} pool_item_t;
+
+typedef struct {
+    const char *name;
+    size_t size;
+    int max_free;
+
+    GMutex *lock;
+    pool_item_t *local;
+    gpointer remote;
+    gint cached;
+
+    gint allocs;
+    gint hits;
+    gint live;
+} pool_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+void pool_create(pool_t *pool, const char *name, size_t size, int max_free);
+void pool_destroy(pool_t *pool);
+void *pool_alloc(pool_t *pool);
+void *pool_alloc0(pool_t *pool);
+void pool_free(pool_t *pool, void *p);
+
+#endif
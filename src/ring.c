@@ -0,0 +1,194 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  ring.c
+**      A bounded lock free queue of pointers, after Dmitry Vyukov's
+**  bounded MPMC queue.  Each cell carries a sequence number which tells
+**  producers and consumers whether it is free, filled, or still being
+**  written, so neither side ever takes a lock or sees a half written cell.
+**
+**  We use these for the commands we hand to the spice worker, which must
+**  never be told the queue is empty just because another thread happened
+**  to hold a lock at the time it asked.
+**--------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+
+#include "x11spice.h"
+#include "ring.h"
+
+/* Sequence numbers wrap; do their arithmetic unsigned */
+#define SEQ_ADD(a, n)   ((gint) ((guint) (a) + (guint) (n)))
+#define SEQ_DIFF(a, b)  ((gint) ((guint) (a) - (guint) (b)))
+
+int ring_create(ring_t *ring, guint size)
+{
+    guint i;
+
+    if (size == 0 || (size & (size - 1)) != 0)
+        return X11SPICE_ERR_BADARGS;
+
+    ring->cells = calloc(size, sizeof(*ring->cells));
+    if (!ring->cells)
+        return X11SPICE_ERR_MALLOC;
+
+    for (i = 0; i < size; i++)
+        ring->cells[i].seq = i;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return 0;
+}
+
+/* Note: no other thread may be using the ring */
+void ring_destroy(ring_t *ring, GDestroyNotify free_func)
+{
+    gpointer data;
+
+    while (ring->cells && (data = ring_pop(ring)) != NULL)
+        if (free_func)
+            free_func(data);
+
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+/* Returns FALSE if the ring is full.  The rect is kept in the cell for
+   ring_steal_matching to test */
+gboolean ring_push_rect(ring_t *ring, gpointer data, const ring_rect_t *rect)
+{
+    ring_cell_t *cell;
+    gint pos = g_atomic_int_get(&ring->head);
+    gint diff;
+
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        diff = SEQ_DIFF(g_atomic_int_get(&cell->seq), pos);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange(&ring->head, pos, SEQ_ADD(pos, 1)))
+                break;
+        }
+        else if (diff < 0)
+            return FALSE;
+        pos = g_atomic_int_get(&ring->head);
+    }
+
+    if (rect)
+        cell->rect = *rect;
+    g_atomic_pointer_set(&cell->data, data);
+    g_atomic_int_set(&cell->seq, SEQ_ADD(pos, 1));
+    return TRUE;
+}
+
+gboolean ring_push(ring_t *ring, gpointer data)
+{
+    return ring_push_rect(ring, data, NULL);
+}
+
+/*----------------------------------------------------------------------------
+**  Take the oldest item off the ring, or return NULL if there is none.
+**  Cells emptied by ring_steal_matching are passed over.
+**--------------------------------------------------------------------------*/
+gpointer ring_pop(ring_t *ring)
+{
+    ring_cell_t *cell;
+    gpointer data;
+    gint pos;
+    gint diff;
+
+    do {
+        pos = g_atomic_int_get(&ring->tail);
+        while (1) {
+            cell = &ring->cells[pos & ring->mask];
+            diff = SEQ_DIFF(g_atomic_int_get(&cell->seq), SEQ_ADD(pos, 1));
+            if (diff == 0) {
+                if (g_atomic_int_compare_and_exchange(&ring->tail, pos, SEQ_ADD(pos, 1)))
+                    break;
+            }
+            else if (diff < 0)
+                return NULL;
+            pos = g_atomic_int_get(&ring->tail);
+        }
+
+        do
+            data = g_atomic_pointer_get(&cell->data);
+        while (data && !g_atomic_pointer_compare_and_exchange(&cell->data, data, NULL));
+
+        g_atomic_int_set(&cell->seq, SEQ_ADD(pos, ring->mask + 1));
+    } while (!data);
+
+    return data;
+}
+
+/* An upper bound; it counts cells still being filled or already stolen */
+int ring_length(ring_t *ring)
+{
+    return SEQ_DIFF(g_atomic_int_get(&ring->head), g_atomic_int_get(&ring->tail));
+}
+
+/* The position the next item pushed will take */
+gint ring_position(ring_t *ring)
+{
+    return g_atomic_int_get(&ring->head);
+}
+
+/*----------------------------------------------------------------------------
+**  Remove every queued item at or after position 'from' whose rect match()
+**  accepts, handing each to free_func.  The cells are left empty for
+**  ring_pop to skip over.
+**  match() only sees the rect stored in the cell, never the item: a
+**  consumer may pop the item, and its owner free it, at any moment until
+**  we have claimed it.
+**  Note: only safe from a ring's sole producer, since we rely on no cell
+**        between tail and head being refilled while we look at it.
+**--------------------------------------------------------------------------*/
+int ring_steal_matching(ring_t *ring, gint from, ring_match_func match, gpointer user_data,
+                        GDestroyNotify free_func)
+{
+    ring_cell_t *cell;
+    gpointer data;
+    gint head = g_atomic_int_get(&ring->head);
+    gint pos;
+    int count = 0;
+
+    pos = g_atomic_int_get(&ring->tail);
+    if (SEQ_DIFF(from, pos) > 0)
+        pos = from;
+
+    for (; SEQ_DIFF(head, pos) > 0; pos = SEQ_ADD(pos, 1)) {
+        cell = &ring->cells[pos & ring->mask];
+        if (g_atomic_int_get(&cell->seq) != SEQ_ADD(pos, 1))
+            continue;
+
+        if (!match(&cell->rect, user_data))
+            continue;
+
+        data = g_atomic_pointer_get(&cell->data);
+        if (data && g_atomic_pointer_compare_and_exchange(&cell->data, data, NULL)) {
+            if (free_func)
+                free_func(data);
+            count++;
+        }
+    }
+
+    return count;
+}
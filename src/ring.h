@@ -0,0 +1,64 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <glib.h>
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct {
+    gint left;
+    gint top;
+    gint right;
+    gint bottom;
+} ring_rect_t;
+
+typedef struct {
+    gint seq;
+    gpointer data;
+    ring_rect_t rect;
+} ring_cell_t;
+
+typedef struct {
+    ring_cell_t *cells;
+    guint mask;
+    gint head;
+    gint tail;
+} ring_t;
+
+typedef gboolean (*ring_match_func) (const ring_rect_t *rect, gpointer user_data);
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+int ring_create(ring_t *ring, guint size);
+void ring_destroy(ring_t *ring, GDestroyNotify free_func);
+gboolean ring_push(ring_t *ring, gpointer data);
+gboolean ring_push_rect(ring_t *ring, gpointer data, const ring_rect_t *rect);
+gpointer ring_pop(ring_t *ring);
+int ring_length(ring_t *ring);
+gint ring_position(ring_t *ring);
+int ring_steal_matching(ring_t *ring, gint from, ring_match_func match, gpointer user_data,
+                        GDestroyNotify free_func);
+
+#endif
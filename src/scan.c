@@ -25,12 +25,16 @@
 **  we detect these changes - through periodic scans of the screen
 **  (see scanner_periodic) and through XDAMAGE reports
 **  (see display/handle_damage_notify)
+**
+**  The scanner thread owns the mirror of the screen (display.fullscreen).
+**  Every read and write of it, and its re-creation on a resize, happens on
+**  this thread, so the mirror needs no lock.
 **--------------------------------------------------------------------------*/
 
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <glib.h>
-#include <pixman.h>
 
 #include "x11spice.h"
 #include "session.h"
@@ -42,15 +46,34 @@
 **   to catch changes with a fairly modest set of scans; this scan pattern is
 **   taken from the x11vnc project.
 **--------------------------------------------------------------------------*/
-#define NUM_SCANLINES               32
-#define NUM_HORIZONTAL_TILES        NUM_SCANLINES
-#define MAX_SCAN_FPS                30
 #define MIN_SCAN_FPS                 1
 
 /* If we have more than this number of changes in any given row, we just
    copy the whole row */
 #define SCAN_ROW_THRESHOLD          (NUM_HORIZONTAL_TILES / 2)
 
+/*----------------------------------------------------------------------------
+**  Not every tile deserves the same attention.  Each tile carries a 'heat'
+**   which rises every time a scan finds it changed, or damage is reported
+**   in it, and cools each time a scan finds it unchanged.  A row with no heat at all is only probed once every
+**   COLD_ROW_INTERVAL passes; the probes saved that way are spent on a second
+**   probe of the hottest rows, so a pass never costs more than NUM_SCANLINES
+**   reads, and the fps logic continues to bound our total effort.
+**--------------------------------------------------------------------------*/
+#define TILE_HEAT_BUMP              4
+#define TILE_HEAT_MAX               16
+#define COLD_ROW_INTERVAL           4
+
+/*----------------------------------------------------------------------------
+**  When a scan finds a change, the rest of the changed object is likely
+**   close by.  Like x11vnc, we probe again at an odd offset above and below
+**   the line that changed, and we check the top and bottom lines of the tile
+**   row; a change on a tile edge spills over into the neighboring tile.
+**  NEIGHBOR_PROBE_MAX caps how many extra reads one pass may spend this way.
+**--------------------------------------------------------------------------*/
+#define NEIGHBOR_OFFSET             13
+#define NEIGHBOR_PROBE_MAX          (NUM_SCANLINES / 2)
+
 static int scanlines[NUM_SCANLINES] = {
     0, 16, 8, 24, 4, 20, 12, 28,
     10, 26, 18, 2, 22, 6, 30, 14,
@@ -59,117 +82,1692 @@ static int scanlines[NUM_SCANLINES] = {
 };
 
 
-static QXLDrawable *shm_image_to_drawable(spice_t *s, shm_image_t *shmi, int x, int y)
+/*----------------------------------------------------------------------------
+**  Images are identified by a hash of their pixels, so content that comes
+**   back (a blinking caret, a hover highlight, flipping between two tabs)
+**   gets the same id each time.  We only ask the client to cache an image
+**   the second time we see it; most captures never repeat, and would
+**   just push useful entries out of the client's cache.
+**  Both spice and the client key their image caches on that 64 bit id,
+**   so two different images with the same id would have the client draw
+**   the cached one in place of the new one.  Any well mixed 64 bit hash
+**   makes that as unlikely as the id size allows, so we use a fast one:
+**   FNV-1a over the size and the pixels, finished with a mix so every
+**   pixel bit reaches every bit of the id.
+**  SCAN_IMAGE_IDS remembers the ids we have sent recently; a collision
+**   in that table, unlike one in the ids themselves, only costs us a
+**   cache hint.
+**--------------------------------------------------------------------------*/
+#define FNV_OFFSET_BASIS            G_GUINT64_CONSTANT(0xcbf29ce484222325)
+#define FNV_PRIME                   G_GUINT64_CONSTANT(0x100000001b3)
+
+static guint64 hash_image(shm_image_t *shmi, int left, int top, int right, int bottom)
+{
+    guint64 hash = FNV_OFFSET_BASIS;
+    uint32_t *p;
+    int x, y;
+
+    hash = (hash ^ (guint32) (right - left)) * FNV_PRIME;
+    hash = (hash ^ (guint32) (bottom - top)) * FNV_PRIME;
+    for (y = top; y < bottom; y++) {
+        p = (uint32_t *) ((uint8_t *) shmi->shmaddr + y * shmi->bytes_per_line);
+        for (x = left; x < right; x++)
+            hash = (hash ^ p[x]) * FNV_PRIME;
+    }
+
+    /* The murmur3 finalizer */
+    hash ^= hash >> 33;
+    hash *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    hash *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+    hash ^= hash >> 33;
+
+    return hash ? hash : 1;
+}
+
+static void set_image_id(scanner_t *scanner, QXLImage *image, shm_image_t *shmi,
+                         int left, int top, int right, int bottom)
+{
+    guint64 id = hash_image(shmi, left, top, right, bottom);
+    guint64 *seen = &scanner->image_ids[id % SCAN_IMAGE_IDS];
+
+    image->descriptor.id = id;
+    image->descriptor.flags = 0;
+    scanner->images_sent++;
+
+    if (*seen == id) {
+        image->descriptor.flags = SPICE_IMAGE_FLAGS_CACHE_ME;
+        scanner->images_cached++;
+    }
+    else
+        *seen = id;
+}
+
+/*----------------------------------------------------------------------------
+**  Build a drawable for the area [left, top, right, bottom) of shmi,
+**  which was captured at screen position x, y.  The bitmap points
+**  into the shm segment, keeping its stride, so no pixels are copied.
+**--------------------------------------------------------------------------*/
+static QXLDrawable *shm_image_to_drawable(spice_t *s, shm_image_t *shmi, int x, int y,
+                                          int left, int top, int right, int bottom,
+                                          int cacheable)
 {
     QXLDrawable *drawable;
     QXLImage *qxl_image;
+    spice_release_t *release;
     int i;
 
-    drawable = calloc(1, sizeof(*drawable) + sizeof(*qxl_image));
+    drawable = pool_alloc0(&s->session->drawable_pool);
     if (!drawable)
         return NULL;
     qxl_image = (QXLImage *) (drawable + 1);
 
-    drawable->release_info.id = (uint64_t) spice_create_release(s, RELEASE_SHMI, shmi);
-    shmi->drawable_ptr = drawable;
+    release = spice_create_release(s, RELEASE_SHMI, shmi);
+    if (!release) {
+        pool_free(&s->session->drawable_pool, drawable);
+        return NULL;
+    }
+    release->drawable = drawable;
+    g_atomic_int_inc(&shmi->refs);
+    drawable->release_info.id = (uint64_t) release;
 
     drawable->surface_id = 0;
     drawable->type = QXL_DRAW_COPY;
     drawable->effect = QXL_EFFECT_OPAQUE;
     drawable->clip.type = SPICE_CLIP_TYPE_NONE;
-    drawable->bbox.left = x;
-    drawable->bbox.top = y;
-    drawable->bbox.right = x + shmi->w;
-    drawable->bbox.bottom = y + shmi->h;
+    drawable->bbox.left = x + left;
+    drawable->bbox.top = y + top;
+    drawable->bbox.right = x + right;
+    drawable->bbox.bottom = y + bottom;
+
+    for (i = 0; i < 3; ++i)
+        drawable->surfaces_dest[i] = -1;
+
+    drawable->u.copy.src_area.left = 0;
+    drawable->u.copy.src_area.top = 0;
+    drawable->u.copy.src_area.right = right - left;
+    drawable->u.copy.src_area.bottom = bottom - top;
+    drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+
+    drawable->u.copy.src_bitmap = (QXLPHYSICAL) qxl_image;
+
+    qxl_image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    if (cacheable)
+        set_image_id(&s->session->scanner, qxl_image, shmi, left, top, right, bottom);
+    else {
+        qxl_image->descriptor.id = 0;
+        qxl_image->descriptor.flags = 0;
+    }
+    qxl_image->descriptor.width = right - left;
+    qxl_image->descriptor.height = bottom - top;
+
+    qxl_image->bitmap.format = SPICE_BITMAP_FMT_RGBA;
+    qxl_image->bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN | QXL_BITMAP_DIRECT;
+    qxl_image->bitmap.x = right - left;
+    qxl_image->bitmap.y = bottom - top;
+    qxl_image->bitmap.stride = shmi->bytes_per_line;
+    qxl_image->bitmap.palette = 0;
+    qxl_image->bitmap.data = (QXLPHYSICAL) ((uint8_t *) shmi->shmaddr +
+                                            top * shmi->bytes_per_line +
+                                            left * sizeof(uint32_t));
+
+    return drawable;
+}
+
+/*----------------------------------------------------------------------------
+**  Build a COPY_BITS drawable, which has the client fill the area
+**  [left, top, right, bottom) from the same size area at src_x, src_y
+**  of what it already has on screen.
+**--------------------------------------------------------------------------*/
+static QXLDrawable *copy_bits_to_drawable(spice_t *s, int left, int top, int right, int bottom,
+                                          int src_x, int src_y)
+{
+    QXLDrawable *drawable;
+    int i;
+
+    drawable = pool_alloc0(&s->session->drawable_pool);
+    if (!drawable)
+        return NULL;
+
+    drawable->release_info.id =
+        (uint64_t) spice_create_pool_release(s, &s->session->drawable_pool, drawable);
+    if (!drawable->release_info.id) {
+        pool_free(&s->session->drawable_pool, drawable);
+        return NULL;
+    }
+
+    drawable->surface_id = 0;
+    drawable->type = QXL_COPY_BITS;
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    drawable->bbox.left = left;
+    drawable->bbox.top = top;
+    drawable->bbox.right = right;
+    drawable->bbox.bottom = bottom;
 
     for (i = 0; i < 3; ++i)
         drawable->surfaces_dest[i] = -1;
 
-    drawable->u.copy.src_area.left = 0;
-    drawable->u.copy.src_area.top = 0;
-    drawable->u.copy.src_area.right = shmi->w;
-    drawable->u.copy.src_area.bottom = shmi->h;
-    drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    drawable->u.copy_bits.src_pos.x = src_x;
+    drawable->u.copy_bits.src_pos.y = src_y;
+
+    return drawable;
+}
+
+/*----------------------------------------------------------------------------
+**  Build a FILL drawable that paints an area a single color.
+**--------------------------------------------------------------------------*/
+static QXLDrawable *fill_to_drawable(spice_t *s, int left, int top, int right, int bottom,
+                                     uint32_t color)
+{
+    QXLDrawable *drawable;
+    int i;
+
+    drawable = pool_alloc0(&s->session->drawable_pool);
+    if (!drawable)
+        return NULL;
+
+    drawable->release_info.id =
+        (uint64_t) spice_create_pool_release(s, &s->session->drawable_pool, drawable);
+    if (!drawable->release_info.id) {
+        pool_free(&s->session->drawable_pool, drawable);
+        return NULL;
+    }
+
+    drawable->surface_id = 0;
+    drawable->type = QXL_DRAW_FILL;
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    drawable->bbox.left = left;
+    drawable->bbox.top = top;
+    drawable->bbox.right = right;
+    drawable->bbox.bottom = bottom;
+
+    for (i = 0; i < 3; ++i)
+        drawable->surfaces_dest[i] = -1;
+
+    drawable->u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
+    drawable->u.fill.brush.u.color = color;
+    drawable->u.fill.rop_descriptor = SPICE_ROPD_OP_PUT;
+
+    return drawable;
+}
+
+static guint64 get_timeout(scanner_t *scanner)
+{
+    return G_USEC_PER_SEC / scanner->target_fps / NUM_SCANLINES;
+}
+
+static int scanner_queue_length(scanner_t *scanner)
+{
+    int i;
+    int count = 0;
+
+    for (i = 0; i < SCAN_PRIORITIES; i++)
+        count += scanner->queue[i].count;
+
+    return count;
+}
+
+/*----------------------------------------------------------------------------
+**  Choose how fast to scan, in the spirit of x11vnc's choose_delay():
+**   - While the screen is changing, scan as fast as we are allowed, unless
+**     much of the screen is changing at once, or the reports we have already
+**     generated are backing up.  More scanning then just makes more work
+**     that nobody is able to consume.
+**   - Once the screen goes quiet, back off exponentially.
+**   - Never let periodic scans consume more than SCAN_CPU_PERCENT of a cpu.
+**  The inputs are smoothed, so the rate settles rather than oscillates.
+**--------------------------------------------------------------------------*/
+#define SCAN_ACTIVE_USEC            (G_USEC_PER_SEC / 4)
+#define SCAN_BACKOFF_USEC           (2 * G_USEC_PER_SEC)
+#define SCAN_BUSY_PERCENT           50
+#define SCAN_BACKLOG                NUM_SCANLINES
+#define SCAN_CPU_PERCENT            25
+
+static void scan_note_change(scanner_t *scanner)
+{
+    scanner->last_change = g_get_monotonic_time();
+}
+
+static void scan_note_periodic(scanner_t *scanner, gint64 cost, int changed)
+{
+    int ratio = changed * 100 / (NUM_SCANLINES * NUM_HORIZONTAL_TILES);
+
+    scanner->scan_cost = (scanner->scan_cost * 7 + cost) / 8;
+    scanner->change_ratio = (scanner->change_ratio * 7 + ratio) / 8;
+    if (changed)
+        scan_note_change(scanner);
+}
+
+static void scan_choose_fps(scanner_t *scanner)
+{
+    session_t *session = scanner->session;
+    gint64 idle = g_get_monotonic_time() - scanner->last_change;
+    int fps = session->options.max_scan_fps;
+    int backlog;
+
+    if (idle > SCAN_ACTIVE_USEC) {
+        gint64 shift = 1 + (idle - SCAN_ACTIVE_USEC) / SCAN_BACKOFF_USEC;
+        fps = shift >= 31 ? 0 : fps >> shift;
+    }
+    else {
+        if (scanner->change_ratio > SCAN_BUSY_PERCENT)
+            fps /= 2;
+
+        backlog = scanner_queue_length(scanner) + session_draw_backlog(session);
+        if (backlog > SCAN_BACKLOG)
+            fps /= 2;
+    }
+
+    if (scanner->scan_cost > 0)
+        fps = MIN(fps, G_USEC_PER_SEC * SCAN_CPU_PERCENT / 100 / (scanner->scan_cost * NUM_SCANLINES));
+
+    scanner->target_fps = MAX(fps, MIN_SCAN_FPS);
+}
+
+static gboolean scanner_wait_until(scanner_t *scanner, gint64 deadline)
+{
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    return g_cond_wait_until(scanner->cond, scanner->lock, deadline);
+#else
+    GTimeVal end;
+    g_get_current_time(&end);
+    g_time_val_add(&end, deadline - g_get_monotonic_time());
+    return g_cond_timed_wait(scanner->cond, scanner->lock, &end);
+#endif
+}
+
+/*----------------------------------------------------------------------------
+**  Flow control.  Every capture we hand to spice holds a credit, for its
+**   shm image, until spice releases the last drawable made from it.  A
+**   half resolution copy holds one of its own, for its pixels; fills and
+**   COPY_BITS carry no pixels and take none.  Once SCAN_MAX_INFLIGHT
+**   captures or SCAN_MAX_INFLIGHT_BYTES of shm are outstanding, the scanner
+**   stops capturing.  Damage keeps arriving in the dirty bitmap meanwhile,
+**   so when credits return we capture the latest state of each region
+**   once, rather than a series of frames that would be stale before they
+**   were sent.
+**  spice keeps a drawable until a later one covers it, so captures of
+**   separate areas need never come back on their own.  If we are still
+**   starved after SCAN_CREDIT_OOM_USEC, we tell the worker it is out of
+**   memory, which has it release the drawables it is holding.
+**--------------------------------------------------------------------------*/
+#define SCAN_MAX_INFLIGHT           64
+#define SCAN_MAX_INFLIGHT_BYTES     (64 * 1024 * 1024)
+#define SCAN_CREDIT_OOM_USEC        (G_USEC_PER_SEC / 20)
+
+static int scanner_has_credit(scanner_t *scanner)
+{
+    return g_atomic_int_get(&scanner->inflight) < SCAN_MAX_INFLIGHT &&
+        g_atomic_int_get(&scanner->inflight_bytes) < SCAN_MAX_INFLIGHT_BYTES;
+}
+
+static void scanner_take_credit(scanner_t *scanner, int bytes)
+{
+    g_atomic_int_inc(&scanner->inflight);
+    g_atomic_int_add(&scanner->inflight_bytes, bytes);
+}
+
+/* Wait until credits return or the deadline passes */
+static void scanner_wait_for_credit(scanner_t *scanner, gint64 deadline)
+{
+    gint64 oom_at = MIN(deadline, g_get_monotonic_time() + SCAN_CREDIT_OOM_USEC);
+    int oom_sent = FALSE;
+
+    scanner->credit_stalls++;
+
+    g_mutex_lock(scanner->lock);
+    g_atomic_int_set(&scanner->credit_starved, TRUE);
+    while (!scanner->exiting && !scanner->resize_pending && !scanner_has_credit(scanner)) {
+        if (scanner_wait_until(scanner, oom_sent ? deadline : oom_at))
+            continue;
+        if (oom_sent)
+            break;
+
+        g_mutex_unlock(scanner->lock);
+        spice_qxl_oom(&scanner->session->spice.display_sin);
+        scanner->credit_ooms++;
+        oom_sent = TRUE;
+        g_mutex_lock(scanner->lock);
+    }
+    g_atomic_int_set(&scanner->credit_starved, FALSE);
+    g_mutex_unlock(scanner->lock);
+}
+
+/*----------------------------------------------------------------------------
+**  A capture often changes in a few separate horizontal bands; a scroll
+**   leaves the newly exposed strip at one end and perhaps a status line at
+**   the other.  Rather than one drawable spanning all of it, we send one
+**   per band, each trimmed to its changed columns.  Bands closer together
+**   than SCAN_BAND_GAP rows are joined.
+**--------------------------------------------------------------------------*/
+#define SCAN_BAND_GAP               8
+#define SCAN_MAX_BANDS              8
+
+static int find_changed_bands(display_t *d, shm_image_t *shmi, int x, int y, int band_gap,
+                              int bands[SCAN_MAX_BANDS][2])
+{
+    int count = 0;
+    int gap = 0;
+    int i;
+
+    for (i = 0; i < shmi->h; i++) {
+        if (!display_row_changed(d, shmi, x, y, i)) {
+            gap++;
+            continue;
+        }
+
+        if (count > 0 && (gap < band_gap || count == SCAN_MAX_BANDS))
+            bands[count - 1][1] = i + 1;
+        else {
+            bands[count][0] = i;
+            bands[count][1] = i + 1;
+            count++;
+        }
+        gap = 0;
+    }
+
+    return count;
+}
+
+/*----------------------------------------------------------------------------
+**  Progressive refinement.  On a slow link, an area that keeps changing
+**   is better sent fast than sent perfectly.  So with the progressive
+**   option, a larger area that is already hot in our tile map, or that
+**   we sent lossy only a moment ago, goes out at half resolution, for
+**   the client to scale up.  We remember it, and once it has been still
+**   for refine-delay, we send it again in full from the mirror, which
+**   always holds the exact pixels.
+**  When we have the client copy an area, by a scroll or a window move,
+**   any half resolution pixels in the source go with it, so the spot
+**   they land on is refined too.
+**--------------------------------------------------------------------------*/
+#define SCAN_REFINE_MIN_AREA        (64 * 64)
+#define SCAN_REFINE_HEAT            (2 * TILE_HEAT_BUMP)
+#define SCAN_REFINE_BATCH           4
+
+static int rects_touch(scan_refine_t *a, int x, int y, int w, int h)
+{
+    return x <= a->x + a->w && a->x <= x + w && y <= a->y + a->h && a->y <= y + h;
+}
+
+static int area_is_hot(scanner_t *scanner, int x, int y, int w, int h)
+{
+    display_t *d = &scanner->session->display;
+    int tile_w = MAX(d->fullscreen->w / NUM_HORIZONTAL_TILES, 1);
+    int tile_h = MAX(d->fullscreen->h / NUM_SCANLINES, 1);
+    int row, col;
+
+    for (row = y / tile_h; row <= (y + h - 1) / tile_h && row < NUM_SCANLINES; row++)
+        for (col = x / tile_w; col <= (x + w - 1) / tile_w && col < NUM_HORIZONTAL_TILES; col++)
+            if (scanner->tile_heat[row][col] >= SCAN_REFINE_HEAT)
+                return 1;
+
+    return 0;
+}
+
+/* Damage we capture never shows up in a scan, so it heats its tiles here */
+static void heat_area(scanner_t *scanner, int x, int y, int w, int h)
+{
+    display_t *d = &scanner->session->display;
+    int tile_w = MAX(d->fullscreen->w / NUM_HORIZONTAL_TILES, 1);
+    int tile_h = MAX(d->fullscreen->h / NUM_SCANLINES, 1);
+    int row, col;
+
+    for (row = y / tile_h; row <= (y + h - 1) / tile_h && row < NUM_SCANLINES; row++)
+        for (col = x / tile_w; col <= (x + w - 1) / tile_w && col < NUM_HORIZONTAL_TILES; col++)
+            scanner->tile_heat[row][col] = MIN(scanner->tile_heat[row][col] + TILE_HEAT_BUMP,
+                                               TILE_HEAT_MAX);
+}
+
+static int refine_wanted(session_t *session, int x, int y, int w, int h)
+{
+    scanner_t *scanner = &session->scanner;
+    int i;
+
+    if (!session->options.progressive || w * h < SCAN_REFINE_MIN_AREA)
+        return 0;
+
+    for (i = 0; i < scanner->refine_count; i++)
+        if (rects_touch(&scanner->refine[i], x, y, w, h))
+            return 1;
+
+    return area_is_hot(scanner, x, y, w, h);
+}
+
+static void refine_union(scan_refine_t *a, int x, int y, int w, int h)
+{
+    int right = MAX(a->x + a->w, x + w);
+    int bottom = MAX(a->y + a->h, y + h);
+
+    a->x = MIN(a->x, x);
+    a->y = MIN(a->y, y);
+    a->w = right - a->x;
+    a->h = bottom - a->y;
+}
+
+static void refine_add(scanner_t *scanner, int x, int y, int w, int h)
+{
+    scan_refine_t *best = NULL;
+    gint64 best_area = 0;
+    gint64 area;
+    int i;
+
+    /* Join an area it touches; failing that, take a free slot; failing
+       that, join whichever area grows least */
+    for (i = 0; i < scanner->refine_count; i++)
+        if (rects_touch(&scanner->refine[i], x, y, w, h)) {
+            best = &scanner->refine[i];
+            break;
+        }
+
+    if (!best && scanner->refine_count < SCAN_REFINE_MAX) {
+        best = &scanner->refine[scanner->refine_count++];
+        best->x = x;
+        best->y = y;
+        best->w = w;
+        best->h = h;
+    }
+    else if (!best) {
+        for (i = 0; i < scanner->refine_count; i++) {
+            area = (gint64) (MAX(scanner->refine[i].x + scanner->refine[i].w, x + w) -
+                             MIN(scanner->refine[i].x, x)) *
+                (MAX(scanner->refine[i].y + scanner->refine[i].h, y + h) -
+                 MIN(scanner->refine[i].y, y)) -
+                (gint64) scanner->refine[i].w * scanner->refine[i].h;
+            if (!best || area < best_area) {
+                best_area = area;
+                best = &scanner->refine[i];
+            }
+        }
+    }
+
+    refine_union(best, x, y, w, h);
+    best->sent = g_get_monotonic_time();
+}
+
+/* The client is copying left,top-right,bottom from dx,dy pixels away */
+static void refine_copy(scanner_t *scanner, int left, int top, int right, int bottom,
+                        int dx, int dy)
+{
+    int count = scanner->refine_count;
+    scan_refine_t a;
+    int l, t, r, b;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        a = scanner->refine[i];
+        l = MAX(a.x, left - dx);
+        t = MAX(a.y, top - dy);
+        r = MIN(a.x + a.w, right - dx);
+        b = MIN(a.y + a.h, bottom - dy);
+        if (l < r && t < b)
+            refine_add(scanner, l + dx, t + dy, r - l, b - t);
+    }
+}
+
+/* Half resolution copy of an area of shmi, averaging each 2x2 block */
+static QXLDrawable *lossy_to_drawable(spice_t *s, shm_image_t *shmi, int x, int y,
+                                      int left, int top, int right, int bottom)
+{
+    QXLDrawable *drawable;
+    QXLImage *qxl_image;
+    spice_release_t *release;
+    uint32_t *pixels;
+    uint32_t *row0, *row1;
+    uint32_t a, b, c, e;
+    int w = (right - left + 1) / 2;
+    int h = (bottom - top + 1) / 2;
+    int i, j;
+    int x0, x1;
+
+    drawable = calloc(1, sizeof(*drawable) + sizeof(*qxl_image) + w * h * sizeof(*pixels));
+    if (!drawable)
+        return NULL;
+    qxl_image = (QXLImage *) (drawable + 1);
+    pixels = (uint32_t *) (qxl_image + 1);
+
+    for (j = 0; j < h; j++) {
+        row0 = (uint32_t *) ((uint8_t *) shmi->shmaddr + (top + 2 * j) * shmi->bytes_per_line);
+        row1 = (uint32_t *) ((uint8_t *) shmi->shmaddr +
+                             MIN(top + 2 * j + 1, bottom - 1) * shmi->bytes_per_line);
+        for (i = 0; i < w; i++) {
+            x0 = left + 2 * i;
+            x1 = MIN(x0 + 1, right - 1);
+            a = row0[x0];
+            b = row0[x1];
+            c = row1[x0];
+            e = row1[x1];
+            pixels[j * w + i] =
+                ((((a & 0xff00ff) + (b & 0xff00ff) + (c & 0xff00ff) + (e & 0xff00ff)) >> 2) &
+                 0xff00ff) |
+                ((((a & 0xff00) + (b & 0xff00) + (c & 0xff00) + (e & 0xff00)) >> 2) & 0xff00);
+        }
+    }
+
+    release = spice_create_release(s, RELEASE_LOSSY, drawable);
+    if (!release) {
+        free(drawable);
+        return NULL;
+    }
+    drawable->release_info.id = (uint64_t) release;
+    scanner_take_credit(&s->session->scanner, w * h * sizeof(*pixels));
+
+    drawable->surface_id = 0;
+    drawable->type = QXL_DRAW_COPY;
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    drawable->bbox.left = x + left;
+    drawable->bbox.top = y + top;
+    drawable->bbox.right = x + right;
+    drawable->bbox.bottom = y + bottom;
+
+    for (i = 0; i < 3; ++i)
+        drawable->surfaces_dest[i] = -1;
+
+    drawable->u.copy.src_area.left = 0;
+    drawable->u.copy.src_area.top = 0;
+    drawable->u.copy.src_area.right = w;
+    drawable->u.copy.src_area.bottom = h;
+    drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    drawable->u.copy.scale_mode = SPICE_IMAGE_SCALE_MODE_INTERPOLATE;
+
+    drawable->u.copy.src_bitmap = (QXLPHYSICAL) qxl_image;
+
+    qxl_image->descriptor.id = 0;
+    qxl_image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    qxl_image->descriptor.flags = 0;
+    qxl_image->descriptor.width = w;
+    qxl_image->descriptor.height = h;
+
+    qxl_image->bitmap.format = SPICE_BITMAP_FMT_RGBA;
+    qxl_image->bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN | QXL_BITMAP_DIRECT;
+    qxl_image->bitmap.x = w;
+    qxl_image->bitmap.y = h;
+    qxl_image->bitmap.stride = w * sizeof(*pixels);
+    qxl_image->bitmap.palette = 0;
+    qxl_image->bitmap.data = (QXLPHYSICAL) pixels;
+
+    return drawable;
+}
+
+/* Send an area again, in full, from the mirror; returns 1 if queued */
+static int refine_area(session_t *session, scan_refine_t *a)
+{
+    display_t *d = &session->display;
+    QXLDrawable *drawable;
+    shm_image_t *shmi;
+    int x = a->x;
+    int y = a->y;
+    int w = MIN(a->x + a->w, d->fullscreen->w) - x;
+    int h = MIN(a->y + a->h, d->fullscreen->h) - y;
+    int i;
+
+    if (w <= 0 || h <= 0)
+        return 0;
+
+    shmi = create_shm_image(d, w, h);
+    if (!shmi)
+        return 0;
+    for (i = 0; i < h; i++)
+        memcpy((uint8_t *) shmi->shmaddr + i * shmi->bytes_per_line,
+               (uint32_t *) d->fullscreen->shmaddr + (y + i) * d->fullscreen->w + x,
+               w * sizeof(uint32_t));
+    scanner_take_credit(&session->scanner, shmi->h * shmi->bytes_per_line);
+
+    drawable = shm_image_to_drawable(&session->spice, shmi, x, y, 0, 0, w, h, TRUE);
+    if (drawable) {
+        session_push_draw(session, drawable);
+        session->scanner.refined++;
+    }
+
+    spice_unref_shm_image(&session->spice, shmi);
+
+    return drawable != NULL;
+}
+
+static int scanner_refine(scanner_t *scanner)
+{
+    gint64 now = g_get_monotonic_time();
+    gint64 delay = (gint64) scanner->session->options.refine_delay * 1000;
+    int queued = 0;
+    int sent = 0;
+    int i = 0;
+
+    while (i < scanner->refine_count && sent < SCAN_REFINE_BATCH) {
+        if (now - scanner->refine[i].sent < delay) {
+            i++;
+            continue;
+        }
+        if (!scanner_has_credit(scanner))
+            break;
+
+        if (!stream_active(&scanner->session->stream))
+            queued += refine_area(scanner->session, &scanner->refine[i]);
+        scanner->refine[i] = scanner->refine[--scanner->refine_count];
+        sent++;
+    }
+
+    return queued;
+}
+
+/*----------------------------------------------------------------------------
+**  Cleared terminals, blank pages and plain backgrounds are common, and
+**   cost a lot to send as bitmaps.  So we walk a changed area in strips
+**   of SCAN_FILL_ROWS rows; runs of strips that are all one color go as
+**   fills, and the rest go as bitmaps, as before.
+**  spice picks a compressor for each image as a whole:  quic (or jpeg, on
+**   a slow link) for images it finds smooth, and lz or glz for the rest.
+**   An image that is half text and half photo suits neither.  So we also
+**   sort the other strips into text and photo, and send runs of each as
+**   separate images; photos also skip the client cache, as they seldom
+**   repeat exactly.  A single strip of one amid the other joins the run
+**   around it, so a busy page does not break up into many small images.
+**  A strip that is not all one color may still hold a wide solid stretch,
+**   such as the blank margin beside a column of text.  If a run of whole
+**   tiles of one color is at least SCAN_FILL_SPLIT_WIDTH wide, we fill
+**   it, and treat the parts either side as changed areas of their own.
+**   Strips split at the same place with the same color form one run.
+**--------------------------------------------------------------------------*/
+#define SCAN_FILL_ROWS              16
+#define SCAN_FILL_MIN_WIDTH         16
+#define SCAN_FILL_SPLIT_WIDTH       128
+
+/* Tiles with few colors, or many sharp edges, are text */
+#define SCAN_CLASS_TILE_WIDTH       32
+#define SCAN_TEXT_COLORS            16
+#define SCAN_SHARP_EDGE             64
+#define SCAN_TEXT_EDGE_PERCENT      25
+
+enum { STRIP_END = -1, STRIP_TEXT, STRIP_SOLID, STRIP_PHOTO, STRIP_SPLIT };
+
+static int is_sharp_edge(uint32_t a, uint32_t b)
+{
+    int i;
+    int diff;
+
+    for (i = 0; i < 24; i += 8) {
+        diff = (int) ((a >> i) & 0xff) - (int) ((b >> i) & 0xff);
+        if (diff >= SCAN_SHARP_EDGE || diff <= -SCAN_SHARP_EDGE)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Looks at every other row, which is plenty to tell the two apart */
+static int tile_is_text(shm_image_t *shmi, int left, int top, int right, int bottom)
+{
+    uint32_t colors[SCAN_TEXT_COLORS];
+    uint32_t *p;
+    int count = 0;
+    int edges = 0;
+    int pairs = 0;
+    int x, y;
+    int i;
+
+    for (y = top; y < bottom; y += 2) {
+        p = (uint32_t *) ((uint8_t *) shmi->shmaddr + y * shmi->bytes_per_line);
+        for (x = left; x < right; x++) {
+            if (count <= SCAN_TEXT_COLORS) {
+                for (i = 0; i < count && i < SCAN_TEXT_COLORS; i++)
+                    if (colors[i] == p[x])
+                        break;
+                if (i == count) {
+                    if (count < SCAN_TEXT_COLORS)
+                        colors[i] = p[x];
+                    count++;
+                }
+            }
+            if (x > left) {
+                edges += is_sharp_edge(p[x - 1], p[x]);
+                pairs++;
+            }
+        }
+    }
+
+    return count <= SCAN_TEXT_COLORS || edges * 100 > pairs * SCAN_TEXT_EDGE_PERCENT;
+}
+
+static int classify_strip(scanner_t *scanner, shm_image_t *shmi,
+                          int left, int top, int right, int bottom)
+{
+    int text = 0;
+    int photo = 0;
+    int x;
+
+    for (x = left; x < right; x += SCAN_CLASS_TILE_WIDTH)
+        if (tile_is_text(shmi, x, top, MIN(x + SCAN_CLASS_TILE_WIDTH, right), bottom))
+            text++;
+        else
+            photo++;
+
+    scanner->text_tiles += text;
+    scanner->photo_tiles += photo;
+
+    return photo > text ? STRIP_PHOTO : STRIP_TEXT;
+}
+
+static int strip_is_solid(shm_image_t *shmi, int left, int top, int right, int bottom,
+                          uint32_t *color)
+{
+    uint32_t *p;
+    int x, y;
+
+    p = (uint32_t *) ((uint8_t *) shmi->shmaddr + top * shmi->bytes_per_line);
+    *color = p[left];
+    for (y = top; y < bottom; y++) {
+        p = (uint32_t *) ((uint8_t *) shmi->shmaddr + y * shmi->bytes_per_line);
+        for (x = left; x < right; x++)
+            if (p[x] != *color)
+                return 0;
+    }
+
+    return 1;
+}
+
+/* Returns the number of drawables queued, or -1 on failure */
+/* Find the widest run of whole tiles that are all one color */
+static int strip_solid_tiles(shm_image_t *shmi, int left, int top, int right, int bottom,
+                             uint32_t *color, int split[2])
+{
+    uint32_t run_color = 0;
+    uint32_t c;
+    int start = -1;
+    int x;
+
+    split[0] = split[1] = left;
+    for (x = left; x < right; x += SCAN_CLASS_TILE_WIDTH) {
+        if (x + SCAN_CLASS_TILE_WIDTH <= right &&
+            strip_is_solid(shmi, x, top, x + SCAN_CLASS_TILE_WIDTH, bottom, &c)) {
+            if (start < 0 || c != run_color) {
+                start = x;
+                run_color = c;
+            }
+            if (x + SCAN_CLASS_TILE_WIDTH - start > split[1] - split[0]) {
+                split[0] = start;
+                split[1] = x + SCAN_CLASS_TILE_WIDTH;
+                *color = run_color;
+            }
+        }
+        else
+            start = -1;
+    }
+
+    return split[1] - split[0] >= SCAN_FILL_SPLIT_WIDTH;
+}
+
+static int strip_kind(session_t *session, shm_image_t *shmi, int left, int top,
+                      int right, int bottom, int level, uint32_t *color, int split[2])
+{
+    if (top >= bottom)
+        return STRIP_END;
+    if (level < 1 || right - left < SCAN_FILL_MIN_WIDTH)
+        return STRIP_TEXT;
+    if (strip_is_solid(shmi, left, top, right, bottom, color))
+        return STRIP_SOLID;
+    if (strip_solid_tiles(shmi, left, top, right, bottom, color, split))
+        return STRIP_SPLIT;
+    return classify_strip(&session->scanner, shmi, left, top, right, bottom);
+}
+
+static int push_changed_area(session_t *session, shm_image_t *shmi, int x, int y,
+                             int left, int top, int right, int bottom, int level, int lossy);
+
+/* Returns the number of drawables queued, or -1 if one could not be made */
+static int push_run(session_t *session, shm_image_t *shmi, int x, int y,
+                    int left, int top, int right, int bottom, int kind, uint32_t color,
+                    int split[2], int level, int lossy)
+{
+    QXLDrawable *drawable;
+    int queued = 0;
+    int rc;
+
+    if (kind == STRIP_SPLIT) {
+        rc = push_run(session, shmi, x, y, split[0], top, split[1], bottom, STRIP_SOLID, color,
+                      NULL, level, lossy);
+        if (rc >= 0)
+            queued += rc;
+        if (rc >= 0 && (rc = push_changed_area(session, shmi, x, y, left, top, split[0],
+                                               bottom, level, lossy)) >= 0)
+            queued += rc;
+        if (rc >= 0 && (rc = push_changed_area(session, shmi, x, y, split[1], top, right,
+                                               bottom, level, lossy)) >= 0)
+            queued += rc;
+        return rc < 0 ? -1 : queued;
+    }
+
+    if (kind == STRIP_SOLID)
+        drawable = fill_to_drawable(&session->spice, x + left, y + top, x + right, y + bottom,
+                                    color);
+    else if (lossy)
+        drawable = lossy_to_drawable(&session->spice, shmi, x, y, left, top, right, bottom);
+    else
+        drawable = shm_image_to_drawable(&session->spice, shmi, x, y, left, top, right, bottom,
+                                         kind == STRIP_TEXT && level >= 1);
+    if (!drawable)
+        return -1;
+
+    session_push_draw(session, drawable);
+    if (kind == STRIP_SOLID)
+        session->scanner.fills++;
+    else if (lossy) {
+        refine_add(&session->scanner, x + left, y + top, right - left, bottom - top);
+        session->scanner.lossy_sent++;
+    }
+    else if (kind == STRIP_PHOTO)
+        session->scanner.photo_images++;
+    else
+        session->scanner.text_images++;
+
+    return 1;
+}
+
+static int push_changed_area(session_t *session, shm_image_t *shmi, int x, int y,
+                             int left, int top, int right, int bottom, int level, int lossy)
+{
+    uint32_t run_color = 0;
+    uint32_t color = 0;
+    uint32_t next_color = 0;
+    int run_split[2] = { 0, 0 };
+    int split[2] = { 0, 0 };
+    int next_split[2] = { 0, 0 };
+    int run_top = top;
+    int run_kind = STRIP_END;
+    int kind;
+    int next_kind;
+    int queued = 0;
+    int row;
+    int end;
+    int rc;
+
+    if (top >= bottom || left >= right)
+        return 0;
+
+    kind = strip_kind(session, shmi, left, top, right, MIN(top + SCAN_FILL_ROWS, bottom),
+                      level, &color, split);
+    for (row = top; row <= bottom; row = end) {
+        end = MIN(row + SCAN_FILL_ROWS, bottom);
+        next_kind = strip_kind(session, shmi, left, end, right, MIN(end + SCAN_FILL_ROWS, bottom),
+                               level, &next_color, next_split);
+
+        /* A lone text strip amid photo, or photo amid text, joins the run */
+        if ((kind == STRIP_TEXT || kind == STRIP_PHOTO) &&
+            (run_kind == STRIP_TEXT || run_kind == STRIP_PHOTO) &&
+            kind != run_kind && next_kind != kind)
+            kind = run_kind;
+
+        /* Send the run once a strip does not match it */
+        if (run_kind != kind ||
+            ((kind == STRIP_SOLID || kind == STRIP_SPLIT) && color != run_color) ||
+            (kind == STRIP_SPLIT && (split[0] != run_split[0] || split[1] != run_split[1]))) {
+            if (run_kind != STRIP_END) {
+                rc = push_run(session, shmi, x, y, left, run_top, right, row, run_kind,
+                              run_color, run_split, level, lossy);
+                if (rc < 0)
+                    return -1;
+                queued += rc;
+            }
+
+            run_top = row;
+            run_kind = kind;
+            run_color = color;
+            run_split[0] = split[0];
+            run_split[1] = split[1];
+        }
+
+        if (row == bottom)
+            break;
+        kind = next_kind;
+        color = next_color;
+        split[0] = next_split[0];
+        split[1] = next_split[1];
+    }
+
+    return queued;
+}
+
+/*----------------------------------------------------------------------------
+**  Spice will stream an area as video once it sees a run of same size
+**   drawables over the same spot, but our updates of a playing video
+**   come out in whatever pieces damage and the change detection give us,
+**   so they never qualify.
+**  So we watch what each batch of reports changed, grouping the changes
+**   into connected regions; unrelated changers elsewhere on the screen (a
+**   clock, a spinner) stay out of a video's region.  When a large region
+**   keeps changing over the same spot, most of it each time, at video
+**   rates, we start sending that whole area as a single drawable each
+**   time any of it changes, which is what spice looks for.  We go back
+**   to normal once the area has been still for a while.
+**--------------------------------------------------------------------------*/
+#define SCAN_VIDEO_MIN_AREA         (160 * 120)
+#define SCAN_VIDEO_SLOP             16
+#define SCAN_VIDEO_COVERAGE         50
+#define SCAN_VIDEO_MIN_FRAMES       10
+#define SCAN_VIDEO_MIN_FPS          10
+#define SCAN_VIDEO_IDLE_USEC        (G_USEC_PER_SEC / 2)
+
+static int video_region_touches(scan_video_region_t *r, int left, int top, int right, int bottom)
+{
+    return left <= r->right + SCAN_VIDEO_SLOP && r->left <= right + SCAN_VIDEO_SLOP &&
+        top <= r->bottom + SCAN_VIDEO_SLOP && r->top <= bottom + SCAN_VIDEO_SLOP;
+}
+
+static void video_region_grow(scan_video_region_t *r, int left, int top, int right, int bottom,
+                              gint64 changed)
+{
+    r->left = MIN(r->left, left);
+    r->top = MIN(r->top, top);
+    r->right = MAX(r->right, right);
+    r->bottom = MAX(r->bottom, bottom);
+    r->changed += changed;
+}
+
+static void video_note_area(scanner_t *scanner, int left, int top, int right, int bottom)
+{
+    scan_video_t *v = &scanner->video;
+    scan_video_region_t *r;
+    int i;
+    int n;
+
+    for (n = 0; n < v->region_count; n++)
+        if (video_region_touches(&v->regions[n], left, top, right, bottom))
+            break;
+
+    /* With this much going on at once, there is no one video to find */
+    if (n == SCAN_VIDEO_REGIONS)
+        return;
+
+    if (n == v->region_count) {
+        v->region_count++;
+        v->regions[n].left = left;
+        v->regions[n].top = top;
+        v->regions[n].right = right;
+        v->regions[n].bottom = bottom;
+        v->regions[n].changed = (gint64) (right - left) * (bottom - top);
+        return;
+    }
+    video_region_grow(&v->regions[n], left, top, right, bottom,
+                      (gint64) (right - left) * (bottom - top));
+
+    /* Growing may have joined it to other regions */
+    for (i = 0; i < v->region_count;) {
+        r = &v->regions[i];
+        if (i == n || !video_region_touches(r, v->regions[n].left, v->regions[n].top,
+                                            v->regions[n].right, v->regions[n].bottom)) {
+            i++;
+            continue;
+        }
+        video_region_grow(&v->regions[n], r->left, r->top, r->right, r->bottom, r->changed);
+        *r = v->regions[--v->region_count];
+        if (n == v->region_count)
+            n = i;
+        i = 0;
+    }
+}
+
+/* Reports wholly inside an active video area are left to video_send_frame */
+static int video_covers(scan_video_t *v, scan_report_t *r)
+{
+    if (!v->active || r->x + r->w <= v->x || r->x >= v->x + v->w ||
+        r->y + r->h <= v->y || r->y >= v->y + v->h)
+        return 0;
+
+    v->dirty = TRUE;
+    return r->x >= v->x && r->x + r->w <= v->x + v->w &&
+        r->y >= v->y && r->y + r->h <= v->y + v->h;
+}
+
+static int video_near_candidate(scan_video_candidate_t *c, scan_video_region_t *r)
+{
+    return abs(r->left - c->x) <= SCAN_VIDEO_SLOP &&
+        abs(r->top - c->y) <= SCAN_VIDEO_SLOP &&
+        abs(r->right - (c->x + c->w)) <= SCAN_VIDEO_SLOP &&
+        abs(r->bottom - (c->y + c->h)) <= SCAN_VIDEO_SLOP;
+}
+
+static void video_new_candidate(scan_video_t *v, scan_video_region_t *r, gint64 now)
+{
+    scan_video_candidate_t *c = &v->candidates[0];
+    int i;
+
+    /* Take a free slot, or else the one that changed longest ago */
+    for (i = 0; i < SCAN_VIDEO_CANDIDATES && c->hits; i++)
+        if (!v->candidates[i].hits || v->candidates[i].last < c->last)
+            c = &v->candidates[i];
+
+    c->x = r->left;
+    c->y = r->top;
+    c->w = r->right - r->left;
+    c->h = r->bottom - r->top;
+    c->hits = 1;
+    c->first = c->last = now;
+}
+
+/* Returns 1 if the region counted as another frame of c, and c is now video */
+static int video_frame(scan_video_t *v, scan_video_candidate_t *c, scan_video_region_t *r,
+                       gint64 now)
+{
+    int right = MAX(c->x + c->w, r->right);
+    int bottom = MAX(c->y + c->h, r->bottom);
+
+    /* Grow the candidate to take in the whole of the video */
+    c->x = MIN(c->x, r->left);
+    c->y = MIN(c->y, r->top);
+    c->w = right - c->x;
+    c->h = bottom - c->y;
+
+    /* A video changes most of its area every frame */
+    if (r->changed * 100 < (gint64) c->w * c->h * SCAN_VIDEO_COVERAGE)
+        return 0;
+
+    c->hits++;
+    c->last = now;
+    if (c->hits < SCAN_VIDEO_MIN_FRAMES)
+        return 0;
+
+    if ((gint64) c->hits * G_USEC_PER_SEC < SCAN_VIDEO_MIN_FPS * (now - c->first)) {
+        c->hits = 0;
+        return 0;
+    }
+
+    v->x = c->x;
+    v->y = c->y;
+    v->w = c->w;
+    v->h = c->h;
+    return 1;
+}
+
+static void video_detect(scanner_t *scanner, gint64 now)
+{
+    scan_video_t *v = &scanner->video;
+    scan_video_region_t *r;
+    scan_video_candidate_t *c;
+    gint64 area;
+    int i, j;
+
+    for (j = 0; j < SCAN_VIDEO_CANDIDATES; j++)
+        if (v->candidates[j].hits && now - v->candidates[j].last > SCAN_VIDEO_IDLE_USEC)
+            v->candidates[j].hits = 0;
+
+    for (i = 0; i < v->region_count; i++) {
+        r = &v->regions[i];
+        area = (gint64) (r->right - r->left) * (r->bottom - r->top);
+        if (area < SCAN_VIDEO_MIN_AREA || r->changed * 100 < area * SCAN_VIDEO_COVERAGE)
+            continue;
+
+        for (j = 0, c = NULL; j < SCAN_VIDEO_CANDIDATES && !c; j++)
+            if (v->candidates[j].hits && video_near_candidate(&v->candidates[j], r))
+                c = &v->candidates[j];
+
+        if (!c)
+            video_new_candidate(v, r, now);
+        else if (video_frame(v, c, r, now)) {
+            memset(v->candidates, 0, sizeof(v->candidates));
+            v->active = TRUE;
+            v->dirty = TRUE;
+            v->frames = 0;
+            v->streams++;
+            v->last = now;
+            g_debug("streaming video area %dx%d+%d+%d", v->w, v->h, v->x, v->y);
+            return;
+        }
+    }
+}
+
+/* Returns 1 if a drawable was queued for spice */
+static int video_send_frame(session_t *session)
+{
+    display_t *d = &session->display;
+    scan_video_t *v = &session->scanner.video;
+    int bands[SCAN_MAX_BANDS][2];
+    QXLDrawable *drawable = NULL;
+    shm_image_t *shmi;
+
+    v->dirty = FALSE;
+    if (v->x + v->w > d->fullscreen->w || v->y + v->h > d->fullscreen->h) {
+        v->active = FALSE;
+        return 0;
+    }
+
+    shmi = create_shm_image(d, v->w, v->h);
+    if (!shmi)
+        return 0;
+
+    if (read_shm_image(d, shmi, v->x, v->y)) {
+        destroy_shm_image(d, shmi);
+        return 0;
+    }
+    scanner_take_credit(&session->scanner, shmi->h * shmi->bytes_per_line);
+
+    if (find_changed_bands(d, shmi, v->x, v->y, SCAN_BAND_GAP, bands) > 0) {
+        drawable = shm_image_to_drawable(&session->spice, shmi, v->x, v->y,
+                                         0, 0, v->w, v->h, FALSE);
+        if (drawable) {
+            session_push_draw(session, drawable);
+            display_copy_image_into_fullscreen(d, shmi, v->x, v->y);
+            v->frames++;
+        }
+    }
+
+    spice_unref_shm_image(&session->spice, shmi);
+
+    return drawable != NULL;
+}
+
+/* Called after each batch of reports; returns 1 if a drawable was queued */
+static int video_end_batch(scanner_t *scanner)
+{
+    scan_video_t *v = &scanner->video;
+    gint64 now = g_get_monotonic_time();
+    int queued = 0;
+
+    if (v->active) {
+        if (v->dirty) {
+            queued = video_send_frame(scanner->session);
+            v->last = now;
+        }
+        else if (now - v->last > SCAN_VIDEO_IDLE_USEC) {
+            g_debug("video area %dx%d+%d+%d went still after %d frames",
+                    v->w, v->h, v->x, v->y, v->frames);
+            v->active = FALSE;
+        }
+    }
+    else
+        video_detect(scanner, now);
+
+    v->region_count = 0;
+
+    return queued;
+}
+
+/*----------------------------------------------------------------------------
+**  The compression level decides how much work we put into shrinking
+**   updates; see compression-level in x11spice.conf.  A level the
+**   operator configured is used as is; otherwise spice raises the
+**   default by one when it is set up to compress images hardest.
+**--------------------------------------------------------------------------*/
+static int scan_compression_level(session_t *session)
+{
+    int level = session->options.compression_level;
+
+    if (!session->options.compression_level_set)
+        level += g_atomic_int_get(&session->spice.compression_level);
+
+    return MIN(level, MAX_COMPRESSION_LEVEL);
+}
+
+static int scan_band_gap(shm_image_t *shmi, int level)
+{
+    if (level < 1)
+        return shmi->h;
+    if (level > 1)
+        return SCAN_BAND_GAP / 2;
+    return SCAN_BAND_GAP;
+}
+
+/*----------------------------------------------------------------------------
+**  A top level window moved.  We have the client copy the window's pixels
+**   from where they were, and do the same to our mirror.  Then we queue
+**   both the old and new areas to be checked against the screen; that
+**   picks up whatever the window uncovered, and fixes anything the copy
+**   got wrong, while the rest is dropped as unchanged.
+**  While we are streaming video, the recapture is all we need.
+**--------------------------------------------------------------------------*/
+static int handle_move_report(session_t *session, scan_report_t *r)
+{
+    display_t *d = &session->display;
+    QXLDrawable *drawable = NULL;
+    int left = MAX(r->x, MAX(0, r->dx));
+    int top = MAX(r->y, MAX(0, r->dy));
+    int right = MIN(r->x + r->w, MIN(d->fullscreen->w, d->fullscreen->w + r->dx));
+    int bottom = MIN(r->y + r->h, MIN(d->fullscreen->h, d->fullscreen->h + r->dy));
+
+    if (!stream_active(&session->stream) && left < right && top < bottom) {
+        drawable = copy_bits_to_drawable(&session->spice, left, top, right, bottom,
+                                         left - r->dx, top - r->dy);
+        if (drawable) {
+            display_move_area(d, left - r->dx, top - r->dy, right - left, bottom - top,
+                              left, top);
+            refine_copy(&session->scanner, left, top, right, bottom, r->dx, r->dy);
+            session_push_draw(session, drawable);
+        }
+    }
+
+    scanner_push(&session->scanner, DAMAGE_SCAN_REPORT, r->x, r->y, r->w, r->h);
+    scanner_push(&session->scanner, DAMAGE_SCAN_REPORT, r->x - r->dx, r->y - r->dy, r->w, r->h);
+
+    return drawable != NULL;
+}
+
+/* Returns 1 if a drawable was queued for spice; the caller must wake it */
+static int handle_scan_report(session_t *session, scan_report_t *r)
+{
+    display_t *d = &session->display;
+    shm_image_t *shmi;
+    QXLDrawable *drawable;
+    int bands[SCAN_MAX_BANDS][2];
+    int left, top, right, bottom;
+    int queued = 0;
+    int streaming = stream_active(&session->stream);
+    int level = scan_compression_level(session);
+    int count;
+    int dy;
+    int rc;
+    int i;
+
+    if (r->type == MOVE_SCAN_REPORT)
+        return handle_move_report(session, r);
+
+    if (!streaming && video_covers(&session->scanner.video, r))
+        return 0;
+
+    shmi = create_shm_image(d, r->w, r->h);
+    if (!shmi) {
+        g_debug("Unexpected failure to create_shm_image of area %dx%d", r->w, r->h);
+        return 0;
+    }
+
+    if (read_shm_image(d, shmi, r->x, r->y)) {
+        g_debug("Unexpected failure to read shm of area %dx%d", r->w, r->h);
+        destroy_shm_image(d, shmi);
+        return 0;
+    }
+    //save_ximage_pnm(shmi);
+
+    scanner_take_credit(&session->scanner, shmi->h * shmi->bytes_per_line);
+
+    /* If the area scrolled, have the client move what it already has */
+    dy = streaming || level < 1 ? 0 : display_find_scroll(d, shmi, r->x, r->y);
+    if (dy) {
+        top = dy > 0 ? r->y + dy : r->y;
+        bottom = dy > 0 ? r->y + r->h : r->y + r->h + dy;
+        drawable = copy_bits_to_drawable(&session->spice, r->x, top, r->x + r->w, bottom,
+                                         r->x, top - dy);
+        if (drawable) {
+            display_move_area(d, r->x, top - dy, r->w, bottom - top, r->x, top);
+            refine_copy(&session->scanner, r->x, top, r->x + r->w, bottom, 0, dy);
+            session_push_draw(session, drawable);
+            queued++;
+        }
+    }
+
+    /*
+    **  Damage often covers pixels that were redrawn unchanged; don't send them.
+    **  While we are streaming video, the changes just go into the mirror,
+    **  for stream_update to encode.
+    */
+    count = find_changed_bands(d, shmi, r->x, r->y, scan_band_gap(shmi, level), bands);
+    for (i = 0; !streaming && i < count; i++) {
+        top = bands[i][0];
+        bottom = bands[i][1];
+        display_find_changed_area(d, shmi, r->x, r->y, &left, &top, &right, &bottom);
+
+        rc = push_changed_area(session, shmi, r->x, r->y, left, top, right, bottom, level,
+                               refine_wanted(session, r->x + left, r->y + top,
+                                             right - left, bottom - top));
+        video_note_area(&session->scanner, r->x + left, r->y + top, r->x + right, r->y + bottom);
+        heat_area(&session->scanner, r->x + left, r->y + top, right - left, bottom - top);
+        if (rc < 0) {
+            g_debug("Unexpected failure to create drawable");
+            break;
+        }
+        queued += rc;
+    }
+    if (count > 0)
+        display_copy_image_into_fullscreen(d, shmi, r->x, r->y);
+    if (count > 0 && streaming)
+        session->stream.dirty = TRUE;
+
+    /*
+    **  NOTE: each drawable holds a reference to the shmi; the last
+    **        one released by spice returns it to us.
+    */
+    spice_unref_shm_image(&session->spice, shmi);
+
+    return queued > 0;
+}
+
+
+/*----------------------------------------------------------------------------
+**  Give the video stream its turn.  The client's display has not been
+**   updated while it was watching the stream, so when the stream stops,
+**   we send it the whole of the mirror.
+**--------------------------------------------------------------------------*/
+static int send_mirror(session_t *session)
+{
+    display_t *d = &session->display;
+    QXLDrawable *drawable;
+    shm_image_t *shmi;
+
+    shmi = create_shm_image(d, d->fullscreen->w, d->fullscreen->h);
+    if (!shmi)
+        return 0;
+    memcpy(shmi->shmaddr, d->fullscreen->shmaddr, shmi->h * shmi->bytes_per_line);
+    scanner_take_credit(&session->scanner, shmi->h * shmi->bytes_per_line);
+
+    drawable = shm_image_to_drawable(&session->spice, shmi, 0, 0, 0, 0, shmi->w, shmi->h, FALSE);
+    if (drawable)
+        session_push_draw(session, drawable);
+
+    spice_unref_shm_image(&session->spice, shmi);
+
+    return drawable != NULL;
+}
+
+static int scanner_stream(scanner_t *scanner)
+{
+    session_t *session = scanner->session;
+    int was_active = stream_active(&session->stream);
+
+    stream_update(&session->stream, session->display.fullscreen);
+    if (was_active && !stream_active(&session->stream))
+        return send_mirror(session);
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------
+**  Pending scan reports are kept in a fixed ring, so queueing one costs
+**   no allocation, and the scanner lock is only held long enough to move
+**   a report in or out.
+**  To avoid capturing the same area twice, we track the parts of the screen
+**   that already have a report pending in a bitmap of SCAN_CELL_SIZE cells.
+**   Reports are rounded out to whole cells, and a report whose cells are all
+**   set already is redundant.  The bits are set and cleared atomically, so
+**   that test needs no lock; a race between two threads can at worst queue
+**   a duplicate report, which is harmless.
+**--------------------------------------------------------------------------*/
+typedef enum { DIRTY_TEST, DIRTY_SET, DIRTY_CLEAR } dirty_op_t;
+
+/* For DIRTY_TEST, returns whether every cell is set; otherwise
+   returns the number of cells whose state was changed */
+static int dirty_cells_op(scanner_t *scanner, scan_report_t *r, dirty_op_t op)
+{
+    int cx0 = r->x / SCAN_CELL_SIZE;
+    int cx1 = (r->x + r->w - 1) / SCAN_CELL_SIZE;
+    int cy0 = r->y / SCAN_CELL_SIZE;
+    int cy1 = (r->y + r->h - 1) / SCAN_CELL_SIZE;
+    int count = 0;
+    int cy;
+    int word;
+
+    if (cx1 >= SCAN_DIRTY_CELLS || cy1 >= SCAN_DIRTY_CELLS) {
+        if (op == DIRTY_TEST)
+            return FALSE;
+        cx1 = MIN(cx1, SCAN_DIRTY_CELLS - 1);
+        cy1 = MIN(cy1, SCAN_DIRTY_CELLS - 1);
+    }
+
+    for (cy = cy0; cy <= cy1; cy++) {
+        guint *row = scanner->dirty + cy * SCAN_DIRTY_WORDS;
+        for (word = cx0 / 32; word <= cx1 / 32; word++) {
+            int first = MAX(cx0 - word * 32, 0);
+            int last = MIN(cx1 - word * 32, 31);
+            guint mask = (~0U >> (31 - last)) & (~0U << first);
+
+            switch (op) {
+                case DIRTY_TEST:
+                    if (((guint) g_atomic_int_get((gint *) &row[word]) & mask) != mask)
+                        return FALSE;
+                    break;
+
+                case DIRTY_SET:
+                    count += __builtin_popcount(mask & ~g_atomic_int_or(&row[word], mask));
+                    break;
+
+                case DIRTY_CLEAR:
+                    count += __builtin_popcount(mask & g_atomic_int_and(&row[word], ~mask));
+                    break;
+            }
+        }
+    }
+
+    return op == DIRTY_TEST ? TRUE : count;
+}
+
+static void dirty_clear_all(scanner_t *scanner)
+{
+    int i;
+    int count = 0;
+
+    for (i = 0; i < SCAN_DIRTY_CELLS * SCAN_DIRTY_WORDS; i++)
+        if (scanner->dirty[i])
+            count += __builtin_popcount(g_atomic_int_and(&scanner->dirty[i], 0));
+
+    g_atomic_int_add(&scanner->dirty_cells, -count);
+}
+
+/* Round a report out to whole cells, clipped to the screen.
+   Returns FALSE if nothing is left */
+static int round_to_cells(scanner_t *scanner, scan_report_t *r)
+{
+    display_t *d = &scanner->session->display;
+    int x2 = MIN(r->x + r->w, d->width);
+    int y2 = MIN(r->y + r->h, d->height);
+
+    r->x = MAX(r->x, 0) / SCAN_CELL_SIZE * SCAN_CELL_SIZE;
+    r->y = MAX(r->y, 0) / SCAN_CELL_SIZE * SCAN_CELL_SIZE;
+    x2 = MIN((x2 + SCAN_CELL_SIZE - 1) / SCAN_CELL_SIZE * SCAN_CELL_SIZE, d->width);
+    y2 = MIN((y2 + SCAN_CELL_SIZE - 1) / SCAN_CELL_SIZE * SCAN_CELL_SIZE, d->height);
+
+    r->w = x2 - r->x;
+    r->h = y2 - r->y;
+
+    return r->w > 0 && r->h > 0;
+}
+
+static int scanner_over_threshold(scanner_t *scanner)
+{
+    display_t *d = &scanner->session->display;
+    long cells = (long) ((d->width + SCAN_CELL_SIZE - 1) / SCAN_CELL_SIZE) *
+                 ((d->height + SCAN_CELL_SIZE - 1) / SCAN_CELL_SIZE);
+
+    return (long) g_atomic_int_get(&scanner->dirty_cells) * 100 >
+           cells * scanner->session->options.full_screen_threshold;
+}
+
+/*----------------------------------------------------------------------------
+**  Not all reports are equally urgent.  A small damage report, or one near
+**   the pointer, is most likely the direct result of user input, and its
+**   latency is what the user perceives; it goes first.  Other damage comes
+**   next, and the bulk captures from our periodic scans go last.
+**  So that bulk work cannot starve, a report that has waited longer than
+**   SCAN_MAX_AGE_USEC is served ahead of everything else.
+**  A report over cells that are already pending adds nothing to capture,
+**   but if it is more urgent than the reports that cover those cells, we
+**   move them up to its queue, so they are not left waiting behind bulk
+**   work.
+**--------------------------------------------------------------------------*/
+#define SCAN_INTERACTIVE_AREA       (128 * 128)
+#define SCAN_POINTER_DISTANCE       64
+#define SCAN_MAX_AGE_USEC           (G_USEC_PER_SEC / 10)
+
+/* How far into a queue we look for reports to merge, and how many reports
+   we capture before waking the spice worker */
+#define SCAN_MERGE_WINDOW           16
+#define SCAN_BATCH                  16
+
+static scan_priority_t scanner_priority(scanner_t *scanner, scan_report_t *r)
+{
+    int px;
+    int py;
 
-    drawable->u.copy.src_bitmap = (QXLPHYSICAL) qxl_image;
+    if (r->type != DAMAGE_SCAN_REPORT)
+        return SCAN_PRIORITY_BULK;
 
-    qxl_image->descriptor.id = 0;
-    qxl_image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    if (r->w * r->h <= SCAN_INTERACTIVE_AREA)
+        return SCAN_PRIORITY_INTERACTIVE;
 
-    qxl_image->descriptor.flags = 0;
-    qxl_image->descriptor.width = shmi->w;
-    qxl_image->descriptor.height = shmi->h;
+    px = g_atomic_int_get(&scanner->pointer_x);
+    py = g_atomic_int_get(&scanner->pointer_y);
+    if (px >= r->x - SCAN_POINTER_DISTANCE && px < r->x + r->w + SCAN_POINTER_DISTANCE &&
+        py >= r->y - SCAN_POINTER_DISTANCE && py < r->y + r->h + SCAN_POINTER_DISTANCE)
+        return SCAN_PRIORITY_INTERACTIVE;
 
-    qxl_image->bitmap.format = SPICE_BITMAP_FMT_RGBA;
-    qxl_image->bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN | QXL_BITMAP_DIRECT;
-    qxl_image->bitmap.x = shmi->w;
-    qxl_image->bitmap.y = shmi->h;
-    qxl_image->bitmap.stride = shmi->bytes_per_line;
-    qxl_image->bitmap.palette = 0;
-    qxl_image->bitmap.data = (QXLPHYSICAL) shmi->shmaddr;
+    return SCAN_PRIORITY_DAMAGE;
+}
 
-    return drawable;
+static int scan_reports_overlap(scan_report_t *a, scan_report_t *b)
+{
+    return a->x < b->x + b->w && b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
 }
 
-static guint64 get_timeout(scanner_t *scanner)
+/* Note: scanner lock must be held by caller */
+static void scanner_promote(scanner_t *scanner, scan_report_t *r, scan_priority_t priority)
 {
-    return G_USEC_PER_SEC / scanner->target_fps / NUM_SCANLINES;
+    scan_queue_t *q = &scanner->queue[priority];
+    scan_queue_t *p;
+    int i;
+    int j;
+    int k;
+
+    for (i = priority + 1; i < SCAN_PRIORITIES; i++) {
+        p = &scanner->queue[i];
+        for (j = 0; j < p->count && q->count < SCAN_QUEUE_SIZE;) {
+            scan_report_t *o = &p->reports[(p->head + j) % SCAN_QUEUE_SIZE];
+            if (o->type == MOVE_SCAN_REPORT || !scan_reports_overlap(r, o)) {
+                j++;
+                continue;
+            }
+
+            q->reports[(q->head + q->count) % SCAN_QUEUE_SIZE] = *o;
+            q->count++;
+            for (k = j + 1; k < p->count; k++)
+                p->reports[(p->head + k - 1) % SCAN_QUEUE_SIZE] =
+                    p->reports[(p->head + k) % SCAN_QUEUE_SIZE];
+            p->count--;
+        }
+    }
 }
 
-static void scan_update_fps(scanner_t *scanner, int increment)
+/* Note: scanner lock must be held by caller */
+static scan_queue_t *scanner_next_queue(scanner_t *scanner)
 {
-    scanner->target_fps += increment;
-    if (scanner->target_fps > MAX_SCAN_FPS)
-        scanner->target_fps = MAX_SCAN_FPS;
+    scan_queue_t *q = NULL;
+    gint64 now = g_get_monotonic_time();
+    int i;
 
-    if (scanner->target_fps < MIN_SCAN_FPS)
-        scanner->target_fps = MIN_SCAN_FPS;
+    for (i = 0; i < SCAN_PRIORITIES; i++) {
+        scan_queue_t *p = &scanner->queue[i];
+        if (p->count > 0 && now - p->reports[p->head].queued > SCAN_MAX_AGE_USEC &&
+            (!q || p->reports[p->head].queued < q->reports[q->head].queued))
+            q = p;
+    }
+
+    for (i = 0; !q && i < SCAN_PRIORITIES; i++)
+        if (scanner->queue[i].count > 0)
+            q = &scanner->queue[i];
+
+    return q;
 }
 
-static void handle_scan_report(session_t *session, scan_report_t *r)
+/*----------------------------------------------------------------------------
+**  Adjacent reports are captured as one image.  We only join two reports
+**   when they share a whole edge, so the union is exactly their combined
+**   area and no extra pixels are read.  Only the first few entries of a
+**   queue are considered, which is where adjacent tiles from one scan pass
+**   end up.
+**  Note: scanner lock must be held by caller
+**--------------------------------------------------------------------------*/
+static int scan_reports_adjacent(scan_report_t *a, scan_report_t *b)
 {
-    shm_image_t *shmi;
+    if (a->type == MOVE_SCAN_REPORT || b->type == MOVE_SCAN_REPORT)
+        return 0;
+    if (a->x == b->x && a->w == b->w)
+        return a->y + a->h == b->y || b->y + b->h == a->y;
+    if (a->y == b->y && a->h == b->h)
+        return a->x + a->w == b->x || b->x + b->w == a->x;
+    return 0;
+}
 
-    shmi = create_shm_image(&session->display, r->w, r->h);
-    if (!shmi) {
-        g_debug("Unexpected failure to create_shm_image of area %dx%d", r->w, r->h);
-        return;
+static void scanner_merge_adjacent(scan_queue_t *q, scan_report_t *r)
+{
+    int i;
+    int j;
+
+    for (i = 0; i < q->count && i < SCAN_MERGE_WINDOW; i++) {
+        scan_report_t *o = &q->reports[(q->head + i) % SCAN_QUEUE_SIZE];
+        if (!scan_reports_adjacent(r, o))
+            continue;
+
+        r->w = MAX(r->x + r->w, o->x + o->w) - MIN(r->x, o->x);
+        r->h = MAX(r->y + r->h, o->y + o->h) - MIN(r->y, o->y);
+        r->x = MIN(r->x, o->x);
+        r->y = MIN(r->y, o->y);
+        r->queued = MIN(r->queued, o->queued);
+
+        for (j = i + 1; j < q->count; j++)
+            q->reports[(q->head + j - 1) % SCAN_QUEUE_SIZE] =
+                q->reports[(q->head + j) % SCAN_QUEUE_SIZE];
+        q->count--;
+
+        /* The grown report may now touch entries we already passed */
+        i = -1;
     }
+}
 
-    if (read_shm_image(&session->display, shmi, r->x, r->y) == 0) {
-        //save_ximage_pnm(shmi);
-        g_mutex_lock(session->lock);
-        display_copy_image_into_fullscreen(&session->display, shmi, r->x, r->y);
-        g_mutex_unlock(session->lock);
+/* Returns 1 if a report was popped, 0 if the deadline passed or a full
+   screen scan is wanted, and -1 if the scanner is exiting */
+static int scanner_pop(scanner_t *scanner, scan_report_t *r, gint64 deadline)
+{
+    scan_queue_t *q;
+    int rc = 0;
 
-        QXLDrawable *drawable = shm_image_to_drawable(&session->spice, shmi, r->x, r->y);
-        if (drawable) {
-            g_async_queue_push(session->draw_queue, drawable);
-            spice_qxl_wakeup(&session->spice.display_sin);
-            /*
-            **  NOTE: the shmi is intentionally not freed at this point.
-            **        The call path will take care of that once it's been
-            **        pushed to Spice.
-            */
-            return;
-        }
-        else
-            g_debug("Unexpected failure to create drawable");
+    g_mutex_lock(scanner->lock);
+    while (!scanner->exiting && !scanner->full_screen_pending && scanner_queue_length(scanner) == 0)
+        if (!scanner_wait_until(scanner, deadline))
+            break;
+
+    if (scanner->exiting)
+        rc = -1;
+    else if (!scanner->full_screen_pending && (q = scanner_next_queue(scanner))) {
+        *r = q->reports[q->head];
+        q->head = (q->head + 1) % SCAN_QUEUE_SIZE;
+        q->count--;
+        scanner_merge_adjacent(q, r);
+        rc = 1;
     }
-    else
-        g_debug("Unexpected failure to read shm of area %dx%d", r->w, r->h);
+    g_mutex_unlock(scanner->lock);
 
-    if (shmi)
-        destroy_shm_image(&session->display, shmi);
-}
+    /* Clear the area before we capture it, so any change made after
+       this point is queued again */
+    if (rc == 1 && r->type != MOVE_SCAN_REPORT)
+        g_atomic_int_add(&scanner->dirty_cells, -dirty_cells_op(scanner, r, DIRTY_CLEAR));
 
+    return rc;
+}
 
-static void free_queue_item(gpointer data)
+/*----------------------------------------------------------------------------
+**  When enough of the screen has changed, it is far cheaper to grab the
+**   whole thing in one shot than to chase down each changed region; this is
+**   what x11vnc does once roughly half of its tiles have changed.
+**  Any reports still queued are subsumed by the full screen capture.
+**--------------------------------------------------------------------------*/
+static void scanner_full_screen(scanner_t *scanner)
 {
-    free(data);
+    scan_report_t r;
+    int i;
+
+    g_mutex_lock(scanner->lock);
+    scanner->full_screen_pending = FALSE;
+    for (i = 0; i < SCAN_PRIORITIES; i++)
+        scanner->queue[i].count = 0;
+    g_mutex_unlock(scanner->lock);
+    dirty_clear_all(scanner);
+
+    r.type = SCANLINE_SCAN_REPORT;
+    r.x = 0;
+    r.y = 0;
+    r.w = scanner->session->display.width;
+    r.h = scanner->session->display.height;
+
+    if (handle_scan_report(scanner->session, &r))
+        spice_qxl_wakeup(&scanner->session->spice.display_sin);
 }
 
-/* Note: session lock must be held by caller */
+/* Note: scanner thread only; it owns the mirror and the tile state */
 static void push_tiles_report(scanner_t *scanner, int start_row, int start_col, int end_row,
                               int end_col)
 {
@@ -286,6 +1884,18 @@ static void push_changed_tiles(scanner_t *scanner, int *tiles_changed_in_row,
                                int tiles_changed[][NUM_HORIZONTAL_TILES])
 {
     int i = 0;
+    int count = 0;
+
+    for (i = 0; i < NUM_SCANLINES; i++)
+        count += tiles_changed_in_row[i];
+
+    if (count * 100 > NUM_SCANLINES * NUM_HORIZONTAL_TILES *
+                      scanner->session->options.full_screen_threshold) {
+        g_mutex_lock(scanner->lock);
+        scanner->full_screen_pending = TRUE;
+        g_mutex_unlock(scanner->lock);
+        return;
+    }
 
     push_changes_across_rows(scanner, tiles_changed_in_row);
 
@@ -295,16 +1905,175 @@ static void push_changed_tiles(scanner_t *scanner, int *tiles_changed_in_row,
 }
 
 
-static void scanner_remove_region(scanner_t *scanner, scan_report_t *r)
+static int row_heat(scanner_t *scanner, int row)
 {
-    pixman_region16_t remove;
-    pixman_region_init_rect(&remove, r->x, r->y, r->w, r->h);
+    int i;
+    int heat = 0;
 
-    g_mutex_lock(scanner->lock);
-    pixman_region_subtract(&scanner->region, &scanner->region, &remove);
-    g_mutex_unlock(scanner->lock);
+    for (i = 0; i < NUM_HORIZONTAL_TILES; i++)
+        heat += scanner->tile_heat[row][i];
+
+    return heat;
+}
+
+static void update_row_heat(scanner_t *scanner, int row, int *tiles)
+{
+    int i;
+
+    for (i = 0; i < NUM_HORIZONTAL_TILES; i++) {
+        if (tiles[i])
+            scanner->tile_heat[row][i] = MIN(scanner->tile_heat[row][i] + TILE_HEAT_BUMP,
+                                             TILE_HEAT_MAX);
+        else if (scanner->tile_heat[row][i] > 0)
+            scanner->tile_heat[row][i]--;
+    }
+}
+
+/* Note: scanner thread only; it owns the mirror and the tile state */
+static int scan_one_row(scanner_t *scanner, int row, int y, int *tiles)
+{
+    int rc;
+
+    if (y >= scanner->session->display.fullscreen->h)
+        y = scanner->session->display.fullscreen->h - 1;
+
+    rc = display_find_changed_tiles(&scanner->session->display, y, tiles, NUM_HORIZONTAL_TILES);
+    if (rc >= 0)
+        update_row_heat(scanner, row, tiles);
+
+    return rc;
+}
+
+/* Note: scanner thread only; it owns the mirror and the tile state */
+static int scan_hot_rows(scanner_t *scanner, int budget, int *probed, int h, int offset,
+                         int *tiles_changed_in_row, int tiles_changed[][NUM_HORIZONTAL_TILES])
+{
+    int extra[NUM_HORIZONTAL_TILES];
+    int i;
+    int j;
+    int rc;
+
+    /* Spend our remaining probes on the hottest rows, at a point
+       away from where the regular pass looked */
+    offset = (offset + h / 2) % MAX(h, 1);
+    while (budget-- > 0) {
+        int hottest = -1;
+        int hottest_heat = 0;
+
+        for (i = 0; i < NUM_SCANLINES; i++) {
+            int heat;
+            if (probed[i] > 1)
+                continue;
+            heat = row_heat(scanner, i);
+            if (heat > hottest_heat) {
+                hottest = i;
+                hottest_heat = heat;
+            }
+        }
+
+        if (hottest == -1)
+            break;
+
+        probed[hottest]++;
+        rc = scan_one_row(scanner, hottest, hottest * h + offset, extra);
+        if (rc < 0)
+            return rc;
+
+        for (j = 0; j < NUM_HORIZONTAL_TILES; j++)
+            if (extra[j] && !tiles_changed[hottest][j]) {
+                tiles_changed[hottest][j]++;
+                tiles_changed_in_row[hottest]++;
+            }
+    }
+
+    return 0;
+}
+
+static void mark_tile(int row, int col, int *tiles_changed_in_row,
+                      int tiles_changed[][NUM_HORIZONTAL_TILES])
+{
+    if (row < 0 || row >= NUM_SCANLINES || col < 0 || col >= NUM_HORIZONTAL_TILES)
+        return;
+
+    if (!tiles_changed[row][col]) {
+        tiles_changed[row][col] = TILE_CHANGED;
+        tiles_changed_in_row[row]++;
+    }
+}
+
+/* Note: scanner thread only; it owns the mirror and the tile state */
+static int probe_neighbor_row(scanner_t *scanner, int y, int h, int *budget,
+                              int *tiles_changed_in_row,
+                              int tiles_changed[][NUM_HORIZONTAL_TILES], int spill)
+{
+    int tiles[NUM_HORIZONTAL_TILES];
+    int row;
+    int rc;
+    int j;
+
+    if (y < 0 || y >= scanner->session->display.fullscreen->h || *budget <= 0)
+        return 0;
+
+    row = MIN(y / h, NUM_SCANLINES - 1);
+    (*budget)--;
+    rc = scan_one_row(scanner, row, y, tiles);
+    if (rc <= 0)
+        return rc;
+
+    for (j = 0; j < NUM_HORIZONTAL_TILES; j++)
+        if (tiles[j]) {
+            mark_tile(row, j, tiles_changed_in_row, tiles_changed);
+            if (spill)
+                mark_tile(row + spill, j, tiles_changed_in_row, tiles_changed);
+        }
+
+    return rc;
+}
 
-    pixman_region_clear(&remove);
+/* Note: scanner thread only; it owns the mirror and the tile state */
+static int probe_neighbors(scanner_t *scanner, int h, int offset, int *found_in_row,
+                           int *tiles_changed_in_row, int tiles_changed[][NUM_HORIZONTAL_TILES])
+{
+    int budget = NEIGHBOR_PROBE_MAX;
+    int i;
+    int j;
+    int y;
+    int rc;
+
+    if (h <= 0)
+        return 0;
+
+    for (i = 0; i < NUM_SCANLINES && budget > 0; i++) {
+        if (!found_in_row[i])
+            continue;
+
+        /* Spill sideways from tiles where the change touched an edge */
+        for (j = 0; j < NUM_HORIZONTAL_TILES; j++) {
+            if (tiles_changed[i][j] & TILE_EDGE_LEFT)
+                mark_tile(i, j - 1, tiles_changed_in_row, tiles_changed);
+            if (tiles_changed[i][j] & TILE_EDGE_RIGHT)
+                mark_tile(i, j + 1, tiles_changed_in_row, tiles_changed);
+        }
+
+        y = MIN(offset + i * h, scanner->session->display.fullscreen->h - 1);
+        rc = probe_neighbor_row(scanner, y - NEIGHBOR_OFFSET, h, &budget,
+                                tiles_changed_in_row, tiles_changed, 0);
+        if (rc >= 0)
+            rc = probe_neighbor_row(scanner, y + NEIGHBOR_OFFSET, h, &budget,
+                                    tiles_changed_in_row, tiles_changed, 0);
+
+        /* A change on the top or bottom line of the tile row will spill up or down */
+        if (rc >= 0 && y != i * h)
+            rc = probe_neighbor_row(scanner, i * h, h, &budget,
+                                    tiles_changed_in_row, tiles_changed, -1);
+        if (rc >= 0 && y != i * h + h - 1)
+            rc = probe_neighbor_row(scanner, i * h + h - 1, h, &budget,
+                                    tiles_changed_in_row, tiles_changed, 1);
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
 }
 
 static void scanner_periodic(scanner_t *scanner)
@@ -312,82 +2081,217 @@ static void scanner_periodic(scanner_t *scanner)
     int i;
     int tiles_changed_in_row[NUM_SCANLINES];
     int tiles_changed[NUM_SCANLINES][NUM_HORIZONTAL_TILES];
+    int found_in_row[NUM_SCANLINES];
+    int probed[NUM_SCANLINES];
+    int budget = 0;
+    int changed = 0;
     int h;
-    int y;
     int offset;
     int rc;
+    gint64 start = g_get_monotonic_time();
 
-    g_mutex_lock(scanner->session->lock);
     h = scanner->session->display.fullscreen->h / NUM_SCANLINES;
 
     offset = scanlines[scanner->current_scanline++];
     scanner->current_scanline %= NUM_SCANLINES;
 
-    for (y = offset, i = 0; i < NUM_SCANLINES; i++, y += h) {
-        if (y >= scanner->session->display.fullscreen->h)
-            y = scanner->session->display.fullscreen->h - 1;
+    for (i = 0; i < NUM_SCANLINES; i++) {
+        tiles_changed_in_row[i] = 0;
+        probed[i] = 0;
 
-        rc = display_find_changed_tiles(&scanner->session->display,
-                                        y, tiles_changed[i], NUM_HORIZONTAL_TILES);
-        if (rc < 0) {
-            g_mutex_unlock(scanner->session->lock);
-            return;
+        if (row_heat(scanner, i) == 0 && ++scanner->row_idle[i] < COLD_ROW_INTERVAL) {
+            memset(tiles_changed[i], 0, sizeof(tiles_changed[i]));
+            budget++;
+            continue;
         }
+        scanner->row_idle[i] = 0;
+
+        probed[i]++;
+        rc = scan_one_row(scanner, i, offset + i * h, tiles_changed[i]);
+        if (rc < 0)
+            return;
 
         tiles_changed_in_row[i] = rc;
     }
+
+    rc = scan_hot_rows(scanner, budget, probed, h, offset, tiles_changed_in_row, tiles_changed);
+    if (rc < 0)
+        return;
+
+    memcpy(found_in_row, tiles_changed_in_row, sizeof(found_in_row));
+    rc = probe_neighbors(scanner, h, offset, found_in_row, tiles_changed_in_row, tiles_changed);
+    if (rc < 0)
+        return;
+
+    for (i = 0; i < NUM_SCANLINES; i++)
+        changed += tiles_changed_in_row[i];
+
     grow_changed_tiles(scanner, tiles_changed_in_row, tiles_changed);
     push_changed_tiles(scanner, tiles_changed_in_row, tiles_changed);
 
-    g_mutex_unlock(scanner->session->lock);
-}
-
-#if ! GLIB_CHECK_VERSION(2, 31, 18)
-static gpointer g_async_queue_timeout_pop(GAsyncQueue *queue, guint64 t)
-{
-    GTimeVal end;
-    g_get_current_time(&end);
-    g_time_val_add(&end, t);
-    return g_async_queue_timed_pop(queue, &end);
+    scan_note_periodic(scanner, g_get_monotonic_time() - start, changed);
 }
-#endif
 
+/*----------------------------------------------------------------------------
+**  The scanner serves two sources of work: reports queued by XDAMAGE (and
+**   by our own scans), and the periodic scan that finds the changes XDAMAGE
+**   does not tell us about.  Periodic scans run on a deadline, rather than
+**   only when the queue goes quiet, so a steady stream of damage cannot
+**   starve them.  Between deadlines, we service the queue.
+**--------------------------------------------------------------------------*/
 static void *scanner_run(void *opaque)
 {
     scanner_t *scanner = (scanner_t *) opaque;
+    gint64 last_periodic = g_get_monotonic_time();
+
+    if (scanner->session->options.compression_level_set)
+        g_message("Compression level %d", scanner->session->options.compression_level);
+    else
+        g_message("Compression level %d, %d when spice compresses images hardest",
+                  scanner->session->options.compression_level,
+                  MIN(scanner->session->options.compression_level + 1, MAX_COMPRESSION_LEVEL));
+
     while (session_alive(scanner->session)) {
-        scan_report_t *r;
-        r = (scan_report_t *) g_async_queue_timeout_pop(scanner->queue, get_timeout(scanner));
-        if (!r) {
-            scan_update_fps(scanner, -1);
+        scan_report_t r;
+        gint64 now;
+        gint64 deadline;
+        int queued;
+        int rc;
+        int i;
+
+        display_reclaim_shm_images(&scanner->session->display);
+
+        if (g_atomic_int_get(&scanner->resize_pending)) {
+            g_atomic_int_set(&scanner->resize_pending, FALSE);
+            session_apply_resize(scanner->session);
+            continue;
+        }
+
+        now = g_get_monotonic_time();
+        deadline = last_periodic + get_timeout(scanner);
+        if (!scanner_has_credit(scanner)) {
+            scanner_wait_for_credit(scanner, MAX(deadline, now + G_USEC_PER_SEC / MIN_SCAN_FPS));
+            continue;
+        }
+
+        if (scanner->full_screen_pending) {
+            scanner_full_screen(scanner);
+            continue;
+        }
+
+        if (scanner_stream(scanner) + scanner_refine(scanner))
+            spice_qxl_wakeup(&scanner->session->spice.display_sin);
+
+        if (now >= deadline) {
             scanner_periodic(scanner);
+            scan_choose_fps(scanner);
+            last_periodic = g_get_monotonic_time();
             continue;
         }
-        scan_update_fps(scanner, 1);
 
-        if (r->type == EXIT_SCAN_REPORT) {
-            free_queue_item(r);
+        rc = scanner_pop(scanner, &r, deadline);
+        if (rc < 0)
             break;
-        }
+        if (rc == 0)
+            continue;
 
-        scanner_remove_region(scanner, r);
+        /* Drain whatever else is already waiting, and wake spice once for
+           the whole batch rather than once per drawable */
+        queued = 0;
+        for (i = 0; rc == 1 && i < SCAN_BATCH; i++) {
+            queued += handle_scan_report(scanner->session, &r);
+            scan_note_change(scanner);
+            if (i + 1 < SCAN_BATCH && scanner_has_credit(scanner))
+                rc = scanner_pop(scanner, &r, 0);
+            else
+                rc = 0;
+        }
+        queued += video_end_batch(scanner);
+        if (queued)
+            spice_qxl_wakeup(&scanner->session->spice.display_sin);
 
-        handle_scan_report(scanner->session, r);
-        free_queue_item(r);
+        scan_choose_fps(scanner);
+        if (rc < 0)
+            break;
     }
 
     return 0;
 }
 
 
+static void scanner_free(scanner_t *scanner)
+{
+    g_cond_free(scanner->cond);
+    scanner->cond = NULL;
+    g_mutex_free(scanner->lock);
+    scanner->lock = NULL;
+
+    free(scanner->dirty);
+    scanner->dirty = NULL;
+
+    free(scanner->image_ids);
+    scanner->image_ids = NULL;
+}
+
 int scanner_create(scanner_t *scanner)
 {
-    scanner->queue = g_async_queue_new_full(free_queue_item);
+    int rc;
+    int i;
+
     scanner->lock = g_mutex_new();
+    scanner->cond = g_cond_new();
+
+    memset(scanner->tile_heat, 0, sizeof(scanner->tile_heat));
+    /* Stagger the cold rows, so they are not all probed in the same pass */
+    for (i = 0; i < NUM_SCANLINES; i++)
+        scanner->row_idle[i] = i % COLD_ROW_INTERVAL;
+
+    scanner->dirty = calloc(SCAN_DIRTY_CELLS * SCAN_DIRTY_WORDS, sizeof(*scanner->dirty));
+    scanner->dirty_cells = 0;
+
+    scanner->image_ids = calloc(SCAN_IMAGE_IDS, sizeof(*scanner->image_ids));
+    scanner->images_sent = 0;
+    scanner->images_cached = 0;
+    memset(&scanner->video, 0, sizeof(scanner->video));
+    scanner->refine_count = 0;
+    scanner->lossy_sent = 0;
+    scanner->refined = 0;
+    scanner->text_tiles = 0;
+    scanner->photo_tiles = 0;
+    scanner->text_images = 0;
+    scanner->photo_images = 0;
+
+    for (i = 0; i < SCAN_PRIORITIES; i++) {
+        scanner->queue[i].head = 0;
+        scanner->queue[i].count = 0;
+    }
+    scanner->exiting = FALSE;
+    scanner->pointer_x = -1;
+    scanner->pointer_y = -1;
     scanner->current_scanline = 0;
-    pixman_region_init(&scanner->region);
     scanner->target_fps = MIN_SCAN_FPS;
-    return pthread_create(&scanner->thread, NULL, scanner_run, scanner);
+    scanner->last_change = g_get_monotonic_time();
+    scanner->scan_cost = 0;
+    scanner->change_ratio = 0;
+    scanner->full_screen_pending = FALSE;
+    scanner->resize_pending = FALSE;
+    scanner->inflight = 0;
+    scanner->inflight_bytes = 0;
+    scanner->credit_starved = FALSE;
+    scanner->credit_stalls = 0;
+    scanner->credit_ooms = 0;
+    scanner->fills = 0;
+
+    if (!scanner->dirty || !scanner->image_ids)
+        rc = X11SPICE_ERR_MALLOC;
+    else
+        rc = pthread_create(&scanner->thread, NULL, scanner_run, scanner);
+
+    /* session_end will still call scanner_destroy; leave it nothing to do */
+    if (rc)
+        scanner_free(scanner);
+
+    return rc;
 }
 
 int scanner_destroy(scanner_t *scanner)
@@ -395,66 +2299,158 @@ int scanner_destroy(scanner_t *scanner)
     void *err;
     int rc;
 
-    scanner_push(scanner, EXIT_SCAN_REPORT, 0, 0, 0, 0);
+    if (!scanner->lock)
+        return 0;
+
+    g_mutex_lock(scanner->lock);
+    scanner->exiting = TRUE;
+    g_cond_broadcast(scanner->cond);
+    g_mutex_unlock(scanner->lock);
+
     rc = pthread_join(scanner->thread, &err);
     if (rc == 0)
         rc = (int) (long) err;
 
-    g_mutex_lock(scanner->lock);
-    if (scanner->queue) {
-        g_async_queue_unref(scanner->queue);
-        scanner->queue = NULL;
-    }
-    pixman_region_clear(&scanner->region);
-
-    g_mutex_unlock(scanner->lock);
-    g_mutex_free(scanner->lock);
-    scanner->lock = NULL;
+    scanner_free(scanner);
+
+    if (scanner->credit_stalls)
+        g_debug("scanner waited on spice for credits %d times, and told it to free "
+                "drawables %d times", scanner->credit_stalls, scanner->credit_ooms);
+    if (scanner->fills)
+        g_debug("scanner sent %d solid areas as fills", scanner->fills);
+    if (scanner->images_sent)
+        g_debug("scanner marked %d of %d images for the client cache",
+                scanner->images_cached, scanner->images_sent);
+    if (scanner->lossy_sent)
+        g_debug("scanner sent %d areas at half resolution, and refined %d areas",
+                scanner->lossy_sent, scanner->refined);
+    if (scanner->text_tiles + scanner->photo_tiles)
+        g_debug("scanner classified %d tiles as text and %d as photo; "
+                "sent %d text and %d photo images",
+                scanner->text_tiles, scanner->photo_tiles,
+                scanner->text_images, scanner->photo_images);
+    if (scanner->video.streams)
+        g_debug("scanner detected %d video areas", scanner->video.streams);
 
     return rc;
 }
 
 int scanner_push(scanner_t *scanner, scan_type_t type, int x, int y, int w, int h)
 {
-    int rc = X11SPICE_ERR_MALLOC;
-    scan_report_t *r = malloc(sizeof(*r));
+    int rc = 0;
+    scan_report_t r;
+    scan_priority_t priority;
+    scan_queue_t *q;
 
-    if (r) {
-        r->type = type;
-        r->x = x;
-        r->y = y;
-        r->w = w;
-        r->h = h;
+    r.type = type;
+    r.x = x;
+    r.y = y;
+    r.w = w;
+    r.h = h;
 
-        g_mutex_lock(scanner->lock);
-        if (scanner->queue) {
-            pixman_box16_t rect;
-            rect.x1 = x;
-            rect.x2 = x + w;
-            rect.y1 = y;
-            rect.y2 = y + h;
+#if defined(DEBUG_SCANLINES)
+    fprintf(stderr, "scan: %dx%d @ %dx%d\n", w, h, x, y);
+    fflush(stderr);
+#endif
 
-            if (!pixman_region_contains_rectangle(&scanner->region, &rect)) {
-                pixman_region_union_rect(&scanner->region, &scanner->region, x, y, w, h);
+    if (!round_to_cells(scanner, &r))
+        return 0;
 
-                g_async_queue_push(scanner->queue, r);
-            }
-            else {
-                free(r);
-            }
-            rc = 0;
+    priority = scanner_priority(scanner, &r);
+    if (dirty_cells_op(scanner, &r, DIRTY_TEST)) {
+        if (priority != SCAN_PRIORITY_BULK) {
+            g_mutex_lock(scanner->lock);
+            scanner_promote(scanner, &r, priority);
+            g_mutex_unlock(scanner->lock);
         }
-        else {
-            free(r);
-            rc = X11SPICE_ERR_SHUTTING_DOWN;
-        }
-        g_mutex_unlock(scanner->lock);
+        return 0;
     }
 
-#if defined(DEBUG_SCANLINES)
-    fprintf(stderr, "scan: %dx%d @ %dx%d\n", w, h, x, y);
-    fflush(stderr);
-#endif
+    g_atomic_int_add(&scanner->dirty_cells, dirty_cells_op(scanner, &r, DIRTY_SET));
+
+    q = &scanner->queue[priority];
+    r.queued = g_get_monotonic_time();
+
+    g_mutex_lock(scanner->lock);
+    if (scanner->exiting)
+        rc = X11SPICE_ERR_SHUTTING_DOWN;
+    else if (q->count == SCAN_QUEUE_SIZE || scanner_over_threshold(scanner))
+        scanner->full_screen_pending = TRUE;
+    else {
+        q->reports[(q->head + q->count) % SCAN_QUEUE_SIZE] = r;
+        q->count++;
+    }
+    g_cond_signal(scanner->cond);
+    g_mutex_unlock(scanner->lock);
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------
+**  Queue a window move.  A move is not an area to capture, so it skips
+**   the dirty bitmap, and goes ahead of everything but other input driven
+**   work; the sooner it is applied, the less of the window we capture
+**   the slow way first.
+**--------------------------------------------------------------------------*/
+int scanner_push_move(scanner_t *scanner, int x, int y, int w, int h, int dx, int dy)
+{
+    int rc = 0;
+    scan_queue_t *q = &scanner->queue[SCAN_PRIORITY_INTERACTIVE];
+    scan_report_t r;
+
+    r.type = MOVE_SCAN_REPORT;
+    r.x = x;
+    r.y = y;
+    r.w = w;
+    r.h = h;
+    r.dx = dx;
+    r.dy = dy;
+    r.queued = g_get_monotonic_time();
+
+    g_mutex_lock(scanner->lock);
+    if (scanner->exiting)
+        rc = X11SPICE_ERR_SHUTTING_DOWN;
+    else if (q->count == SCAN_QUEUE_SIZE)
+        scanner->full_screen_pending = TRUE;
+    else {
+        q->reports[(q->head + q->count) % SCAN_QUEUE_SIZE] = r;
+        q->count++;
+    }
+    g_cond_signal(scanner->cond);
+    g_mutex_unlock(scanner->lock);
 
     return rc;
 }
+
+void scanner_set_pointer(scanner_t *scanner, int x, int y)
+{
+    g_atomic_int_set(&scanner->pointer_x, x);
+    g_atomic_int_set(&scanner->pointer_y, y);
+}
+
+/* Called as spice releases a drawable we captured */
+void scanner_return_credit(scanner_t *scanner, int bytes)
+{
+    g_atomic_int_add(&scanner->inflight, -1);
+    g_atomic_int_add(&scanner->inflight_bytes, -bytes);
+
+    if (g_atomic_int_get(&scanner->credit_starved)) {
+        g_mutex_lock(scanner->lock);
+        g_cond_signal(scanner->cond);
+        g_mutex_unlock(scanner->lock);
+    }
+}
+
+/*----------------------------------------------------------------------------
+**  The screen mirror belongs to the scanner thread, so a resize seen by the
+**   event thread is handed over to be carried out here.  The new mirror is
+**   blank, so we follow up with a full screen capture.
+**--------------------------------------------------------------------------*/
+void scanner_request_resize(scanner_t *scanner)
+{
+    g_mutex_lock(scanner->lock);
+    g_atomic_int_set(&scanner->resize_pending, TRUE);
+    scanner->full_screen_pending = TRUE;
+    g_cond_signal(scanner->cond);
+    g_mutex_unlock(scanner->lock);
+}
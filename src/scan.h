@@ -21,12 +21,27 @@
 #ifndef SCAN_H_
 #define SCAN_H_
 
-#include <pixman.h>
-
 /*----------------------------------------------------------------------------
 **  Definitions and simple types
 **--------------------------------------------------------------------------*/
-typedef enum { DAMAGE_SCAN_REPORT, SCANLINE_SCAN_REPORT, EXIT_SCAN_REPORT } scan_type_t;
+typedef enum { DAMAGE_SCAN_REPORT, SCANLINE_SCAN_REPORT, MOVE_SCAN_REPORT } scan_type_t;
+typedef enum { SCAN_PRIORITY_INTERACTIVE, SCAN_PRIORITY_DAMAGE, SCAN_PRIORITY_BULK,
+               SCAN_PRIORITIES } scan_priority_t;
+
+/* The screen is broken into a grid of tiles for scanning; see scan.c */
+#define NUM_SCANLINES               32
+#define NUM_HORIZONTAL_TILES        NUM_SCANLINES
+
+/* Pending reports are held in a fixed ring, and the parts of the screen
+   they cover are tracked in a bitmap of SCAN_CELL_SIZE square cells */
+#define SCAN_QUEUE_SIZE             512
+#define SCAN_CELL_SIZE              16
+#define SCAN_DIRTY_CELLS            (16384 / SCAN_CELL_SIZE)
+#define SCAN_DIRTY_WORDS            (SCAN_DIRTY_CELLS / 32)
+#define SCAN_IMAGE_IDS              4096
+#define SCAN_REFINE_MAX             64
+#define SCAN_VIDEO_CANDIDATES       4
+#define SCAN_VIDEO_REGIONS          8
 
 struct session_struct;
 /*----------------------------------------------------------------------------
@@ -39,16 +54,100 @@ typedef struct {
     int y;
     int w;
     int h;
+    int dx;
+    int dy;
+    gint64 queued;
 } scan_report_t;
 
+/* What a batch of reports changed, grouped into connected regions */
+typedef struct {
+    int left;
+    int top;
+    int right;
+    int bottom;
+    gint64 changed;
+} scan_video_region_t;
+
+/* A region that has kept changing, and may be playing video */
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+    int hits;
+    gint64 first;
+    gint64 last;
+} scan_video_candidate_t;
+
+/* A stable area the scanner believes is playing video; see scan.c */
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+    gint64 last;
+    int active;
+    int dirty;
+    int frames;
+    int streams;
+    scan_video_candidate_t candidates[SCAN_VIDEO_CANDIDATES];
+    scan_video_region_t regions[SCAN_VIDEO_REGIONS];
+    int region_count;
+} scan_video_t;
+
+/* An area sent lossy, waiting to be sent again in full */
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+    gint64 sent;
+} scan_refine_t;
+
+typedef struct {
+    scan_report_t reports[SCAN_QUEUE_SIZE];
+    int head;
+    int count;
+} scan_queue_t;
+
 typedef struct {
     pthread_t thread;
-    GAsyncQueue *queue;
     struct session_struct *session;
     GMutex *lock;
+    GCond *cond;
+    scan_queue_t queue[SCAN_PRIORITIES];
+    int exiting;
+    gint pointer_x;
+    gint pointer_y;
+    guint *dirty;
+    gint dirty_cells;
     int current_scanline;
-    pixman_region16_t region;
     int target_fps;
+    gint64 last_change;
+    gint64 scan_cost;
+    int change_ratio;
+    int full_screen_pending;
+    int resize_pending;
+    gint inflight;
+    gint inflight_bytes;
+    gint credit_starved;
+    int credit_stalls;
+    int credit_ooms;
+    int fills;
+    guint64 *image_ids;
+    int images_sent;
+    int images_cached;
+    scan_video_t video;
+    scan_refine_t refine[SCAN_REFINE_MAX];
+    int refine_count;
+    int lossy_sent;
+    int refined;
+    int text_tiles;
+    int photo_tiles;
+    int text_images;
+    int photo_images;
+    int tile_heat[NUM_SCANLINES][NUM_HORIZONTAL_TILES];
+    int row_idle[NUM_SCANLINES];
 } scanner_t;
 
 
@@ -59,5 +158,9 @@ int scanner_create(scanner_t *scanner);
 int scanner_destroy(scanner_t *scanner);
 
 int scanner_push(scanner_t *scanner, scan_type_t type, int x, int y, int w, int h);
+int scanner_push_move(scanner_t *scanner, int x, int y, int w, int h, int dx, int dy);
+void scanner_set_pointer(scanner_t *scanner, int x, int y);
+void scanner_return_credit(scanner_t *scanner, int bytes);
+void scanner_request_resize(scanner_t *scanner);
 
 #endif
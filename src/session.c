@@ -29,7 +29,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sched.h>
 #include <errno.h>
 
 #include <xcb/xcb.h>
@@ -69,6 +68,15 @@ void free_draw_queue_item(gpointer data)
     spice_free_release((spice_release_t *) drawable->release_info.id);
 }
 
+/*----------------------------------------------------------------------------
+**  The spice worker pulls commands from lock free rings, so it can never
+**   be told there is nothing to do merely because another thread holds a
+**   lock.  When the primary surface must change, pause_and_flush() sets
+**   draw_paused and waits on the flushed condition until the worker has
+**   finished with the commands it has.  The worker marks itself in progress
+**   *before* it checks draw_paused, so one side or the other always sees
+**   the flag it needs.
+**--------------------------------------------------------------------------*/
 void *session_pop_draw(session_t *session)
 {
     void *ret = NULL;
@@ -76,39 +84,108 @@ void *session_pop_draw(session_t *session)
     if (!session)
         return ret;
 
-    if (!session->running) {
-        session->draw_command_in_progress = FALSE;
-        return ret;
+    g_atomic_int_set(&session->draw_command_in_progress, TRUE);
+    if (session->running && !g_atomic_int_get(&session->draw_paused))
+        ret = ring_pop(&session->draw_queue);
+    if (!ret) {
+        g_atomic_int_set(&session->draw_command_in_progress, FALSE);
+        if (g_atomic_int_get(&session->draw_paused)) {
+            g_mutex_lock(session->lock);
+            g_cond_broadcast(session->flushed);
+            g_mutex_unlock(session->lock);
+        }
+    }
+    else if (g_atomic_int_get(&session->draw_queue_full)) {
+        g_mutex_lock(session->lock);
+        g_cond_signal(session->draw_space);
+        g_mutex_unlock(session->lock);
     }
 
-    if (!g_mutex_trylock(session->lock))
-        return ret;
+    return ret;
+}
 
-    ret = g_async_queue_try_pop(session->draw_queue);
-    session->draw_command_in_progress = (ret != NULL);
-    g_mutex_unlock(session->lock);
+/*----------------------------------------------------------------------------
+**  Queue a drawable for spice.  Any drawable still waiting in the queue
+**  whose area the new one completely covers will never be seen by the
+**  client, so we release it now rather than have spice encode it.
+**  A COPY_BITS reads back what is already on the surface, so nothing
+**  queued ahead of one may be dropped; it acts as a barrier.
+**  Credits meter captures, not drawables, and one capture can make many
+**  drawables, so the ring can fill.  Then we sleep on draw_space, which
+**  session_pop_draw signals once it has made room.
+**  Note: the scanner is the only producer of drawables, which is what
+**        makes ring_steal_matching safe here.
+**--------------------------------------------------------------------------*/
+/* The worker may be paused, or gone; wake up now and then to check */
+#define DRAW_FULL_WAIT_USEC         (G_USEC_PER_SEC / 10)
 
-    return ret;
+static void session_wait_until(GCond *cond, GMutex *lock, gint64 deadline)
+{
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    g_cond_wait_until(cond, lock, deadline);
+#else
+    GTimeVal end;
+    g_get_current_time(&end);
+    g_time_val_add(&end, deadline - g_get_monotonic_time());
+    g_cond_timed_wait(cond, lock, &end);
+#endif
 }
 
-int session_draw_waiting(session_t *session)
+static gboolean drawable_covered_by(const ring_rect_t *inner, gpointer user_data)
 {
-    int ret = 0;
+    QXLRect *outer = &((QXLDrawable *) user_data)->bbox;
 
-    if (!session)
-        return ret;
+    return inner->left >= outer->left && inner->right <= outer->right &&
+        inner->top >= outer->top && inner->bottom <= outer->bottom;
+}
 
-    if (!session->running) {
-        session->draw_command_in_progress = FALSE;
-        return ret;
+void session_push_draw(session_t *session, QXLDrawable *drawable)
+{
+    ring_rect_t rect;
+
+    rect.left = drawable->bbox.left;
+    rect.top = drawable->bbox.top;
+    rect.right = drawable->bbox.right;
+    rect.bottom = drawable->bbox.bottom;
+
+    if (drawable->type == QXL_COPY_BITS)
+        session->draw_barrier = ring_position(&session->draw_queue);
+    else if (drawable->effect == QXL_EFFECT_OPAQUE)
+        session->draw_overdrawn += ring_steal_matching(&session->draw_queue,
+                                                       session->draw_barrier,
+                                                       drawable_covered_by, drawable,
+                                                       free_draw_queue_item);
+
+    if (ring_push_rect(&session->draw_queue, drawable, &rect))
+        return;
+
+    session->draw_full_waits++;
+    g_mutex_lock(session->lock);
+    g_atomic_int_set(&session->draw_queue_full, TRUE);
+    while (!ring_push_rect(&session->draw_queue, drawable, &rect)) {
+        if (!session->running) {
+            free_draw_queue_item(drawable);
+            break;
+        }
+        spice_qxl_wakeup(&session->spice.display_sin);
+        session_wait_until(session->draw_space, session->lock,
+                           g_get_monotonic_time() + DRAW_FULL_WAIT_USEC);
     }
+    g_atomic_int_set(&session->draw_queue_full, FALSE);
+    g_mutex_unlock(session->lock);
+}
 
-    if (!g_mutex_trylock(session->lock))
-        return ret;
+int session_draw_backlog(session_t *session)
+{
+    return ring_length(&session->draw_queue);
+}
 
-    ret = g_async_queue_length(session->draw_queue);
-    g_mutex_unlock(session->lock);
-    return (ret);
+int session_draw_waiting(session_t *session)
+{
+    if (!session || !session->running || g_atomic_int_get(&session->draw_paused))
+        return 0;
+
+    return ring_length(&session->draw_queue);
 }
 
 void *session_pop_cursor(session_t *session)
@@ -116,7 +193,7 @@ void *session_pop_cursor(session_t *session)
     if (!session || !session->running)
         return NULL;
 
-    return g_async_queue_try_pop(session->cursor_queue);
+    return ring_pop(&session->cursor_queue);
 }
 
 int session_cursor_waiting(session_t *session)
@@ -124,7 +201,7 @@ int session_cursor_waiting(session_t *session)
     if (!session || !session->running)
         return 0;
 
-    return g_async_queue_length(session->cursor_queue);
+    return ring_length(&session->cursor_queue);
 }
 
 void session_handle_key(session_t *session, uint8_t keycode, int is_press)
@@ -141,6 +218,8 @@ void session_handle_key(session_t *session, uint8_t keycode, int is_press)
 void session_handle_mouse_position(session_t *session, int x, int y,
                                    uint32_t buttons_state G_GNUC_UNUSED)
 {
+    scanner_set_pointer(&session->scanner, x, y);
+
     if (! session->options.allow_control)
         return;
 
@@ -227,16 +306,23 @@ end:
     return rc;
 }
 
-static void flush_and_lock(session_t *s)
+/* Stop the spice worker taking draw commands, and wait for it to finish
+   with the ones it has */
+static void pause_and_flush(session_t *s)
 {
-    while (1) {
-        g_mutex_lock(s->lock);
-        if (!s->draw_command_in_progress)
-            break;
-
-        g_mutex_unlock(s->lock);
-        sched_yield();
+    g_mutex_lock(s->lock);
+    g_atomic_int_set(&s->draw_paused, TRUE);
+    while (g_atomic_int_get(&s->draw_command_in_progress)) {
+        spice_qxl_wakeup(&s->spice.display_sin);
+        g_cond_wait(s->flushed, s->lock);
     }
+    g_mutex_unlock(s->lock);
+}
+
+static void resume(session_t *s)
+{
+    g_atomic_int_set(&s->draw_paused, FALSE);
+    spice_qxl_wakeup(&s->spice.display_sin);
 }
 
 void session_end(session_t *s)
@@ -299,9 +385,29 @@ int session_create(session_t *s)
     g_thread_init(NULL);
 #endif
 
-    s->cursor_queue = g_async_queue_new_full(free_cursor_queue_item);
-    s->draw_queue = g_async_queue_new_full(free_draw_queue_item);
+    rc = ring_create(&s->cursor_queue, CURSOR_QUEUE_SIZE);
+    if (rc == 0)
+        rc = ring_create(&s->draw_queue, DRAW_QUEUE_SIZE);
+    if (rc)
+        return rc;
+    s->draw_paused = FALSE;
+    s->draw_command_in_progress = FALSE;
+    s->draw_barrier = 0;
     s->lock = g_mutex_new();
+    s->flushed = g_cond_new();
+    s->draw_space = g_cond_new();
+    s->draw_queue_full = FALSE;
+    s->draw_full_waits = 0;
+
+    pool_create(&s->release_pool, "release", sizeof(spice_release_t), DRAW_QUEUE_SIZE);
+    pool_create(&s->drawable_pool, "drawable", sizeof(QXLDrawable) + sizeof(QXLImage),
+                DRAW_QUEUE_SIZE);
+    pool_create(&s->shmi_pool, "shm image", sizeof(shm_image_t), DRAW_QUEUE_SIZE);
+    pool_create(&s->cursor_pool, "cursor",
+                sizeof(QXLCursorCmd) + sizeof(QXLCursor) + POOL_CURSOR_PIXELS * sizeof(uint32_t),
+                CURSOR_QUEUE_SIZE);
+    /* Spice needs the release pool before the session starts */
+    s->spice.session = s;
 
     s->connected = FALSE;
     s->connect_pid = 0;
@@ -315,16 +421,21 @@ int session_create(session_t *s)
 
 void session_destroy(session_t *s)
 {
-    flush_and_lock(s);
+    pause_and_flush(s);
 
-    if (s->cursor_queue)
-        g_async_queue_unref(s->cursor_queue);
-    if (s->draw_queue)
-        g_async_queue_unref(s->draw_queue);
-    s->cursor_queue = NULL;
-    s->draw_queue = NULL;
+    ring_destroy(&s->cursor_queue, free_cursor_queue_item);
+    ring_destroy(&s->draw_queue, free_draw_queue_item);
+    if (s->draw_overdrawn)
+        g_debug("%d queued drawables were overdrawn before spice fetched them",
+                s->draw_overdrawn);
 
-    g_mutex_unlock(s->lock);
+    if (s->draw_full_waits)
+        g_debug("the draw queue was full %d times", s->draw_full_waits);
+
+    g_cond_free(s->draw_space);
+    s->draw_space = NULL;
+    g_cond_free(s->flushed);
+    s->flushed = NULL;
     g_mutex_free(s->lock);
     s->lock = NULL;
 
@@ -338,29 +449,40 @@ void session_destroy(session_t *s)
 
     if (s->options.audit)
         end_audit(s);
+
+    pool_destroy(&s->cursor_pool);
+    pool_destroy(&s->shmi_pool);
+    pool_destroy(&s->drawable_pool);
+    pool_destroy(&s->release_pool);
 }
 
 /* Important note - this is meant to be called from
-    a thread context *other* than the spice worker thread */
+    the scanner thread, which owns the screen mirror */
 int session_recreate_primary(session_t *s)
 {
     int rc;
 
-    flush_and_lock(s);
+    pause_and_flush(s);
     spice_destroy_primary(&s->spice);
     display_destroy_screen_images(&s->display);
 
     rc = display_create_screen_images(&s->display);
     if (rc == 0) {
         shm_image_t *f = s->display.fullscreen;
-        rc = spice_create_primary(&s->spice, f->w, f->h, f->bytes_per_line, f->shmaddr);
+        rc = spice_create_primary(&s->spice, f->w, f->h, f->bytes_per_line);
     }
 
-    g_mutex_unlock(s->lock);
+    resume(s);
     return rc;
 }
 
+/* Called from the event thread; the scanner carries out the resize */
 void session_handle_resize(session_t *s)
+{
+    scanner_request_resize(&s->scanner);
+}
+
+void session_apply_resize(session_t *s)
 {
     if (s->display.width == s->spice.width && s->display.height == s->spice.height)
         return;
@@ -382,7 +504,10 @@ int session_push_cursor_image(session_t *s,
     QXLCursorCmd *ccmd;
     QXLCursor *cursor;
 
-    ccmd = calloc(1, sizeof(*ccmd) + sizeof(*cursor) + imglen);
+    if (sizeof(*ccmd) + sizeof(*cursor) + imglen <= s->cursor_pool.size)
+        ccmd = pool_alloc0(&s->cursor_pool);
+    else
+        ccmd = calloc(1, sizeof(*ccmd) + sizeof(*cursor) + imglen);
     if (!ccmd)
         return X11SPICE_ERR_MALLOC;;
 
@@ -410,9 +535,18 @@ int session_push_cursor_image(session_t *s,
     ccmd->u.set.shape = (QXLPHYSICAL) cursor;
     ccmd->u.set.visible = TRUE;
 
-    ccmd->release_info.id = (uint64_t) spice_create_release(&s->spice, RELEASE_MEMORY, ccmd);
+    if (sizeof(*ccmd) + sizeof(*cursor) + imglen <= s->cursor_pool.size)
+        ccmd->release_info.id =
+            (uint64_t) spice_create_pool_release(&s->spice, &s->cursor_pool, ccmd);
+    else
+        ccmd->release_info.id = (uint64_t) spice_create_release(&s->spice, RELEASE_MEMORY, ccmd);
 
-    g_async_queue_push(s->cursor_queue, ccmd);
+    /* A newer cursor supersedes any the worker has not picked up yet */
+    while (!ring_push(&s->cursor_queue, ccmd)) {
+        QXLCursorCmd *old = ring_pop(&s->cursor_queue);
+        if (old)
+            free_cursor_queue_item(old);
+    }
     spice_qxl_wakeup(&s->spice.display_sin);
 
     return 0;
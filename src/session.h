@@ -25,8 +25,21 @@
 #include "display.h"
 #include "local_spice.h"
 #include "agent.h"
+#include "stream.h"
 #include "gui.h"
 #include "scan.h"
+#include "ring.h"
+#include "pool.h"
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+/* Ring sizes must be a power of two */
+#define DRAW_QUEUE_SIZE             256
+#define CURSOR_QUEUE_SIZE           32
+
+/* Cursors up to this size come from the cursor pool */
+#define POOL_CURSOR_PIXELS          (64 * 64)
 
 /*----------------------------------------------------------------------------
 **  Structure definitions
@@ -36,6 +49,7 @@ typedef struct session_struct {
     display_t display;
     spice_t spice;
     agent_t agent;
+    stream_t stream;
     gui_t gui;
     scanner_t scanner;
     int running;
@@ -49,10 +63,22 @@ typedef struct session_struct {
 #endif
 
     GMutex *lock;
-    int draw_command_in_progress;
-
-    GAsyncQueue *cursor_queue;
-    GAsyncQueue *draw_queue;
+    GCond *flushed;
+    GCond *draw_space;
+    gint draw_queue_full;
+    int draw_full_waits;
+    gint draw_paused;
+    gint draw_command_in_progress;
+
+    ring_t cursor_queue;
+    ring_t draw_queue;
+    gint draw_barrier;
+    int draw_overdrawn;
+
+    pool_t release_pool;
+    pool_t drawable_pool;
+    pool_t shmi_pool;
+    pool_t cursor_pool;
 } session_t;
 
 /*----------------------------------------------------------------------------
@@ -65,9 +91,12 @@ void session_end(session_t *s);
 int session_alive(session_t *s);
 
 void session_handle_resize(session_t *s);
+void session_apply_resize(session_t *s);
 
+void session_push_draw(session_t *session, QXLDrawable *drawable);
 void *session_pop_draw(session_t *session);
 int session_draw_waiting(session_t *session);
+int session_draw_backlog(session_t *session);
 
 void *session_pop_cursor(session_t *session);
 int session_cursor_waiting(session_t *session);
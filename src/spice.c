@@ -32,6 +32,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <spice/macros.h>
+#include <spice/protocol.h>
 
 #include "local_spice.h"
 #include "x11spice.h"
@@ -216,11 +217,124 @@ static void attach_worker(QXLInstance *qin, QXLWorker *qxl_worker G_GNUC_UNUSED)
     spice_qxl_add_memslot(qin, &slot);
 }
 
+/* spice asks for 1 when images are QUIC compressed and video streaming is
+   off, which is when the scanner's work to shrink updates pays most */
 static void set_compression_level(QXLInstance *qin, int level)
 {
     spice_t *s = SPICE_CONTAINEROF(qin, spice_t, display_sin);
-    // TODO - set_compression_level is unused
-    s->compression_level = level;
+    g_debug("spice compression level %d", level);
+    g_atomic_int_set(&s->compression_level, level);
+}
+
+/*----------------------------------------------------------------------------
+**  Video codecs.  spice encodes the areas it decides to stream as video
+**   with the first codec in its list the client can decode.  So when a
+**   client connects, we give spice only the configured codecs that client
+**   can decode, in the order they were configured.  The default list,
+**   DEFAULT_VIDEO_CODECS, puts them cheapest to encode first.
+**--------------------------------------------------------------------------*/
+static const struct {
+    int codec;
+    const char *name;
+    int cap;
+} video_codecs[] = {
+    { SPICE_VIDEO_CODEC_TYPE_MJPEG, "mjpeg", SPICE_DISPLAY_CAP_CODEC_MJPEG },
+    { SPICE_VIDEO_CODEC_TYPE_H264, "h264", SPICE_DISPLAY_CAP_CODEC_H264 },
+    { SPICE_VIDEO_CODEC_TYPE_VP8, "vp8", SPICE_DISPLAY_CAP_CODEC_VP8 },
+    { SPICE_VIDEO_CODEC_TYPE_VP9, "vp9", SPICE_DISPLAY_CAP_CODEC_VP9 },
+    { SPICE_VIDEO_CODEC_TYPE_H265, "h265", SPICE_DISPLAY_CAP_CODEC_H265 },
+};
+
+#define VIDEO_CODEC_COUNT           (sizeof(video_codecs) / sizeof(video_codecs[0]))
+
+/* Returns the codec of one encoder:codec entry of a video codec list */
+static int parse_video_codec(const char *entry)
+{
+    const char *p = strchr(entry, ':');
+    unsigned int i;
+
+    for (i = 0; i < VIDEO_CODEC_COUNT; i++)
+        if (strcmp(p ? p + 1 : entry, video_codecs[i].name) == 0)
+            return video_codecs[i].codec;
+
+    return 0;
+}
+
+static int allowed_video_codecs(const char *list)
+{
+    gchar **entries = g_strsplit(list, ";", -1);
+    int mask = 0;
+    int i;
+
+    for (i = 0; entries[i]; i++)
+        mask |= 1 << parse_video_codec(entries[i]);
+    g_strfreev(entries);
+
+    return mask & ~1;
+}
+
+static int client_has_cap(uint8_t *caps, int cap)
+{
+    return caps[cap / 8] & (1 << (cap % 8));
+}
+
+static gboolean apply_client_video_codecs(gpointer user_data)
+{
+    spice_t *s = (spice_t *) user_data;
+    gchar *list = NULL;
+    GString *chosen = g_string_new("");
+    gchar **entries = g_strsplit(s->video_codecs, ";", -1);
+    int client_codecs = g_atomic_int_get(&s->client_codecs) & ~1;
+    int i;
+
+    for (i = 0; entries[i]; i++)
+        if (client_codecs & (1 << parse_video_codec(entries[i])))
+            g_string_append_printf(chosen, "%s%s", chosen->len ? ";" : "", entries[i]);
+    g_strfreev(entries);
+    list = g_string_free(chosen, FALSE);
+
+    if (!*list)
+        g_message("The client decodes none of the configured video codecs");
+#if SPICE_SERVER_VERSION >= 0x000d02
+    else if (spice_server_set_video_codecs(s->server, list))
+        g_warning("spice did not accept video codecs '%s'", list);
+#endif
+    else
+        g_debug("video codecs for this client: %s", list);
+
+    g_free(s->client_video_codecs);
+    s->client_video_codecs = list;
+
+    return FALSE;
+}
+
+/* Called from the spice worker thread; spice must be reconfigured from ours */
+static void set_client_capabilities(QXLInstance *qin, uint8_t client_present, uint8_t *caps)
+{
+    spice_t *s = SPICE_CONTAINEROF(qin, spice_t, display_sin);
+    int client_codecs = 0;
+    unsigned int i;
+
+    if (!client_present) {
+        g_debug("display client gone");
+        return;
+    }
+
+    /* Clients from before multiple codecs only know mjpeg */
+    if (!client_has_cap(caps, SPICE_DISPLAY_CAP_MULTI_CODEC))
+        client_codecs = 1 << SPICE_VIDEO_CODEC_TYPE_MJPEG;
+    else
+        for (i = 0; i < VIDEO_CODEC_COUNT; i++)
+            if (client_has_cap(caps, video_codecs[i].cap))
+                client_codecs |= 1 << video_codecs[i].codec;
+
+    g_debug("display client capabilities: sized streams %d, stream reports %d, lz4 %d, codecs 0x%x",
+            client_has_cap(caps, SPICE_DISPLAY_CAP_SIZED_STREAM) ? 1 : 0,
+            client_has_cap(caps, SPICE_DISPLAY_CAP_STREAM_REPORT) ? 1 : 0,
+            client_has_cap(caps, SPICE_DISPLAY_CAP_LZ4_COMPRESSION) ? 1 : 0, client_codecs);
+
+    g_atomic_int_set(&s->client_codecs, client_codecs);
+    g_idle_add(apply_client_video_codecs, s);
 }
 
 /* Newer spice servers no longer transmit this information,
@@ -468,10 +582,19 @@ static int send_monitors_config(spice_t *s, int w, int h)
     return 0;
 }
 
-int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shmaddr)
+/*----------------------------------------------------------------------------
+**  The primary surface gets memory of its own.  Spice renders every
+**   command into it, and once we send COPY_BITS, it must not share memory
+**   with our mirror of the screen, or each scroll would be applied twice.
+**--------------------------------------------------------------------------*/
+int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line)
 {
     QXLDevSurfaceCreate surface;
 
+    s->primary = calloc(h, bytes_per_line);
+    if (!s->primary)
+        return X11SPICE_ERR_MALLOC;
+
     memset(&surface, 0, sizeof(surface));
     surface.height = h;
     surface.width = w;
@@ -487,7 +610,7 @@ int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shm
 
     /* TODO - compute this dynamically */
     surface.format = SPICE_SURFACE_FMT_32_xRGB;
-    surface.mem = (QXLPHYSICAL) shmaddr;
+    surface.mem = (QXLPHYSICAL) s->primary;
 
     s->width = w;
     s->height = h;
@@ -500,6 +623,8 @@ int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shm
 void spice_destroy_primary(spice_t *s)
 {
     spice_qxl_destroy_primary_surface(&s->display_sin, 0);
+    free(s->primary);
+    s->primary = NULL;
 }
 
 void initialize_spice_instance(spice_t *s)
@@ -543,7 +668,7 @@ void initialize_spice_instance(spice_t *s)
         .async_complete = async_complete,
         .update_area_complete = update_area_complete,
         .client_monitors_config = client_monitors_config,
-        .set_client_capabilities = NULL,    /* Allowed to be unset */
+        .set_client_capabilities = set_client_capabilities,
     };
 
     static const SpiceKbdInterface keyboard_sif = {
@@ -575,6 +700,81 @@ void initialize_spice_instance(spice_t *s)
 
 }
 
+/*----------------------------------------------------------------------------
+**  Map the compression settings from our config file to spice's values
+**--------------------------------------------------------------------------*/
+typedef struct {
+    const char *name;
+    int value;
+} spice_setting_t;
+
+static const spice_setting_t image_compression_settings[] = {
+    { "off", SPICE_IMAGE_COMPRESSION_OFF },
+    { "auto_glz", SPICE_IMAGE_COMPRESSION_AUTO_GLZ },
+    { "auto_lz", SPICE_IMAGE_COMPRESSION_AUTO_LZ },
+    { "quic", SPICE_IMAGE_COMPRESSION_QUIC },
+    { "glz", SPICE_IMAGE_COMPRESSION_GLZ },
+    { "lz", SPICE_IMAGE_COMPRESSION_LZ },
+#if SPICE_SERVER_VERSION >= 0x000d02
+    { "lz4", SPICE_IMAGE_COMPRESSION_LZ4 },
+#endif
+    { NULL, 0 }
+};
+
+static const spice_setting_t wan_compression_settings[] = {
+    { "auto", SPICE_WAN_COMPRESSION_AUTO },
+    { "always", SPICE_WAN_COMPRESSION_ALWAYS },
+    { "never", SPICE_WAN_COMPRESSION_NEVER },
+    { NULL, 0 }
+};
+
+static const spice_setting_t streaming_video_settings[] = {
+    { "off", SPICE_STREAM_VIDEO_OFF },
+    { "all", SPICE_STREAM_VIDEO_ALL },
+    { "filter", SPICE_STREAM_VIDEO_FILTER },
+    { NULL, 0 }
+};
+
+/* Returns -1 if the setting was not given, or is not one we know */
+static int find_setting(const spice_setting_t *settings, const char *key, const char *name)
+{
+    int i;
+
+    if (!name)
+        return -1;
+
+    for (i = 0; settings[i].name; i++)
+        if (strcmp(settings[i].name, name) == 0)
+            return settings[i].value;
+
+    g_warning("Unknown %s '%s'; using the spice default", key, name);
+    return -1;
+}
+
+static void set_compression_options(spice_t *s, options_t *options)
+{
+    int value;
+
+    value = find_setting(image_compression_settings, "image-compression",
+                         options->image_compression);
+    if (value >= 0)
+        spice_server_set_image_compression(s->server, value);
+
+    value = find_setting(wan_compression_settings, "jpeg-wan-compression",
+                         options->jpeg_wan_compression);
+    if (value >= 0)
+        spice_server_set_jpeg_compression(s->server, value);
+
+    value = find_setting(wan_compression_settings, "zlib-glz-wan-compression",
+                         options->zlib_glz_wan_compression);
+    if (value >= 0)
+        spice_server_set_zlib_glz_compression(s->server, value);
+
+    value = find_setting(streaming_video_settings, "streaming-video", options->streaming_video);
+    if (value >= 0)
+        spice_server_set_streaming_video(s->server, value);
+}
+
 static void set_options(spice_t *s, options_t *options)
 {
     if (options->disable_ticketing)
@@ -585,6 +785,15 @@ static void set_options(spice_t *s, options_t *options)
 
     spice_server_set_exit_on_disconnect(s->server, options->exit_on_disconnect);
 
+    set_compression_options(s, options);
+
+    s->video_codecs = options->video_codecs;
+    s->video_codecs_allowed = allowed_video_codecs(options->video_codecs);
+#if SPICE_SERVER_VERSION >= 0x000d02
+    if (spice_server_set_video_codecs(s->server, options->video_codecs))
+        g_warning("spice did not accept video codecs '%s'", options->video_codecs);
+#endif
+
 }
 
 static int try_listen(spice_t *s, options_t *options)
@@ -675,8 +884,7 @@ int spice_start(spice_t *s, options_t *options, shm_image_t *fullscreen)
 
     spice_server_vm_start(s->server);
 
-    rc = spice_create_primary(s, fullscreen->w, fullscreen->h,
-                              fullscreen->bytes_per_line, fullscreen->shmaddr);
+    rc = spice_create_primary(s, fullscreen->w, fullscreen->h, fullscreen->bytes_per_line);
 
     return rc;
 }
@@ -691,34 +899,83 @@ void spice_end(spice_t *s)
 
     spice_server_destroy(s->server);
 
+    if (s->client_video_codecs)
+        g_debug("last client's video codecs: %s",
+                *s->client_video_codecs ? s->client_video_codecs : "none");
+    g_free(s->client_video_codecs);
+    s->client_video_codecs = NULL;
+
 }
 
 spice_release_t *spice_create_release(spice_t *s, release_type_t type, void *data)
 {
-    spice_release_t *r = malloc(sizeof(*r));
+    spice_release_t *r = pool_alloc(&s->session->release_pool);
     if (r) {
         r->s = s;
         r->type = type;
         r->data = data;
+        r->pool = NULL;
+        r->drawable = NULL;
     }
 
     return r;
 }
 
+/* For data that goes back to pool once spice is done with it */
+spice_release_t *spice_create_pool_release(spice_t *s, pool_t *pool, void *data)
+{
+    spice_release_t *r = spice_create_release(s, RELEASE_POOL, data);
+    if (r)
+        r->pool = pool;
+
+    return r;
+}
+
+/*----------------------------------------------------------------------------
+**  One captured image may back several drawables; each holds a reference,
+**   as does the scanner while it builds them.  The last one to let go
+**   returns the scanner's credit and the image itself.
+**--------------------------------------------------------------------------*/
+void spice_unref_shm_image(spice_t *s, shm_image_t *shmi)
+{
+    if (!g_atomic_int_dec_and_test(&shmi->refs))
+        return;
+
+    scanner_return_credit(&s->session->scanner, shmi->h * shmi->bytes_per_line);
+    if (s->session->running)
+        display_return_shm_image(&s->session->display, shmi);
+    else
+        destroy_shm_image(&s->session->display, shmi);
+}
+
 void spice_free_release(spice_release_t *r)
 {
+    QXLImage *image;
+
     if (!r)
         return;
 
     switch (r->type) {
         case RELEASE_SHMI:
-            destroy_shm_image(&r->s->session->display, (shm_image_t *) r->data);
+            pool_free(&r->s->session->drawable_pool, r->drawable);
+            spice_unref_shm_image(r->s, (shm_image_t *) r->data);
             break;
 
         case RELEASE_MEMORY:
             free(r->data);
             break;
+
+        case RELEASE_POOL:
+            pool_free(r->pool, r->data);
+            break;
+
+        case RELEASE_LOSSY:
+            image = (QXLImage *) ((QXLDrawable *) r->data + 1);
+            scanner_return_credit(&r->s->session->scanner,
+                                  image->descriptor.width * image->descriptor.height * 4);
+            free(r->data);
+            break;
     }
 
-    free(r);
+    pool_free(&r->s->session->release_pool, r);
 }
@@ -0,0 +1,552 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  stream.c
+**      Encode the screen as video, and hand it to spice through its
+**  streaming device, the same interface spice-streaming-agent uses.
+**  This is worth it for full motion content, which costs far too much
+**  to send as bitmaps.
+**
+**  spice talks to us from its own thread; it tells us which codec the
+**  client wants, and reads the messages we queue for it.  Encoding
+**  happens on the scanner thread, which owns the mirror of the screen.
+**--------------------------------------------------------------------------*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "x11spice.h"
+#include "stream.h"
+
+#if defined(HAVE_GSTREAMER)
+
+#include <spice/macros.h>
+#include <spice/stream-device.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+#define STREAM_MIN_FPS              5
+#define STREAM_MAX_FPS              30
+#define STREAM_MIN_BITRATE          256
+#define STREAM_ADAPT_USEC           (G_USEC_PER_SEC / 4)
+#define STREAM_GROW_USEC            G_USEC_PER_SEC
+#define STREAM_MAX_MESSAGE          (64 * 1024)
+
+/*----------------------------------------------------------------------------
+**  The codecs we can encode, cheapest to encode first, which is the
+**   order we pick them in.  The bitrate property is in kbit/s times
+**   bitrate_scale; jpegenc has none.
+**--------------------------------------------------------------------------*/
+static const struct {
+    int codec;
+    const char *factory;
+    const char *encoder;
+    const char *bitrate_property;
+    int bitrate_scale;
+} stream_codecs[] = {
+    { SPICE_VIDEO_CODEC_TYPE_MJPEG, "jpegenc",
+      "jpegenc name=enc",
+      NULL, 0 },
+    { SPICE_VIDEO_CODEC_TYPE_H264, "x264enc",
+      "x264enc name=enc tune=zerolatency speed-preset=ultrafast key-int-max=30 ! "
+      "video/x-h264,stream-format=byte-stream,profile=constrained-baseline",
+      "bitrate", 1 },
+    { SPICE_VIDEO_CODEC_TYPE_VP8, "vp8enc",
+      "vp8enc name=enc deadline=1 cpu-used=16 end-usage=cbr keyframe-max-dist=30",
+      "target-bitrate", 1000 },
+};
+
+static int find_codec(int codec)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(stream_codecs) / sizeof(stream_codecs[0]); i++)
+        if (stream_codecs[i].codec == codec)
+            return i;
+
+    return -1;
+}
+
+/*----------------------------------------------------------------------------
+**  Messages to spice.  These are queued under the lock, and we poke the
+**   notify pipe so that spice's thread comes and reads them.
+**--------------------------------------------------------------------------*/
+static void queue_message(stream_t *stream, int type, const void *data, int size)
+{
+    StreamDevHeader header;
+    int rc;
+
+    header.protocol_version = STREAM_DEVICE_PROTOCOL;
+    header.padding = 0;
+    header.type = GUINT16_TO_LE(type);
+    header.size = GUINT32_TO_LE(size);
+
+    g_mutex_lock(stream->lock);
+    g_byte_array_append(stream->out, (const guint8 *) &header, sizeof(header));
+    if (size > 0)
+        g_byte_array_append(stream->out, data, size);
+    g_mutex_unlock(stream->lock);
+
+    rc = write(stream->notify_fd[1], "", 1);
+    if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        g_debug("stream notify failed: %s", strerror(errno));
+}
+
+static int stream_backlog(stream_t *stream)
+{
+    int len;
+
+    g_mutex_lock(stream->lock);
+    len = stream->out->len;
+    g_mutex_unlock(stream->lock);
+
+    return len;
+}
+
+static void notify_read(int fd, int event G_GNUC_UNUSED, void *opaque)
+{
+    stream_t *stream = (stream_t *) opaque;
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    spice_server_char_device_wakeup(&stream->base);
+}
+
+/*----------------------------------------------------------------------------
+**  Messages from spice
+**--------------------------------------------------------------------------*/
+static void handle_start_stop(stream_t *stream, const uint8_t *data, int size)
+{
+    int codec = 0;
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < sizeof(stream_codecs) / sizeof(stream_codecs[0]) && !codec; i++) {
+        if (!(stream->codecs & (1 << stream_codecs[i].codec)))
+            continue;
+        for (j = 1; size > 0 && j <= data[0] && j < size; j++)
+            if (data[j] == stream_codecs[i].codec)
+                codec = stream_codecs[i].codec;
+    }
+
+    if (size > 0 && data[0] > 0 && !codec)
+        g_warning("The client asked for a video stream in no codec we can encode");
+    else
+        g_debug("client %s video stream, codec %d", codec ? "started" : "stopped", codec);
+
+    g_atomic_int_set(&stream->codec, codec);
+}
+
+static void handle_message(stream_t *stream, int type, const uint8_t *data, int size)
+{
+    switch (type) {
+        case STREAM_TYPE_CAPABILITIES:
+            /* We have no optional capabilities to offer */
+            queue_message(stream, STREAM_TYPE_CAPABILITIES, NULL, 0);
+            break;
+
+        case STREAM_TYPE_START_STOP:
+            handle_start_stop(stream, data, size);
+            break;
+
+        case STREAM_TYPE_NOTIFY_ERROR:
+            g_warning("spice reported a video stream error");
+            break;
+
+        default:
+            g_debug("unexpected stream message type %d", type);
+            break;
+    }
+}
+
+static int stream_char_write(SpiceCharDeviceInstance *sin, const uint8_t *buf, int len)
+{
+    stream_t *stream = SPICE_CONTAINEROF(sin, stream_t, base);
+    StreamDevHeader *header;
+    int size;
+
+    g_byte_array_append(stream->in, buf, len);
+    while (stream->in->len >= sizeof(*header)) {
+        header = (StreamDevHeader *) stream->in->data;
+        size = GUINT32_FROM_LE(header->size);
+        if (size > STREAM_MAX_MESSAGE) {
+            g_warning("Discarding oversized stream message of %d bytes", size);
+            g_byte_array_set_size(stream->in, 0);
+            break;
+        }
+        if (stream->in->len < sizeof(*header) + size)
+            break;
+
+        handle_message(stream, GUINT16_FROM_LE(header->type),
+                       stream->in->data + sizeof(*header), size);
+        g_byte_array_remove_range(stream->in, 0, sizeof(*header) + size);
+    }
+
+    return len;
+}
+
+static int stream_char_read(SpiceCharDeviceInstance *sin, uint8_t *buf, int len)
+{
+    stream_t *stream = SPICE_CONTAINEROF(sin, stream_t, base);
+
+    g_mutex_lock(stream->lock);
+    len = MIN(len, (int) stream->out->len);
+    if (len > 0) {
+        memcpy(buf, stream->out->data, len);
+        g_byte_array_remove_range(stream->out, 0, len);
+    }
+    g_mutex_unlock(stream->lock);
+
+    return len;
+}
+
+static void stream_char_state(SpiceCharDeviceInstance *sin G_GNUC_UNUSED, int connected)
+{
+    g_debug("stream state %d", connected);
+}
+
+/*----------------------------------------------------------------------------
+**  The encoder.  This is built when the client starts a stream, and
+**   rebuilt whenever the codec or the screen size changes.
+**--------------------------------------------------------------------------*/
+static void destroy_pipeline(stream_t *stream)
+{
+    if (!stream->pipeline)
+        return;
+
+    g_debug("video stream ended: %d frames, %d skipped, %d KB, last at %d kbit/s, %d fps",
+            stream->frames, stream->skipped, (int) (stream->bytes / 1024),
+            stream->bitrate, stream->fps);
+
+    gst_element_set_state(stream->pipeline, GST_STATE_NULL);
+    gst_object_unref(stream->encoder);
+    gst_object_unref(stream->sink);
+    gst_object_unref(stream->src);
+    gst_object_unref(stream->pipeline);
+    stream->pipeline = stream->src = stream->sink = stream->encoder = NULL;
+    stream->pipeline_codec = 0;
+}
+
+static void set_bitrate(stream_t *stream)
+{
+    int i = find_codec(stream->pipeline_codec);
+
+    if (i >= 0 && stream_codecs[i].bitrate_property)
+        g_object_set(stream->encoder, stream_codecs[i].bitrate_property,
+                     stream->bitrate * stream_codecs[i].bitrate_scale, NULL);
+}
+
+static int create_pipeline(stream_t *stream, int codec, int width, int height)
+{
+    StreamMsgFormat format;
+    GError *error = NULL;
+    GstCaps *caps;
+    gchar *desc;
+    int i = find_codec(codec);
+
+    if (i < 0)
+        return X11SPICE_ERR_BADARGS;
+
+    desc = g_strdup_printf("appsrc name=src is-live=true format=time do-timestamp=true ! "
+                           "videoconvert ! %s ! appsink name=sink sync=false",
+                           stream_codecs[i].encoder);
+    stream->pipeline = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if (!stream->pipeline) {
+        g_warning("Cannot create %s video pipeline: %s", stream_codecs[i].factory,
+                  error ? error->message : "unknown error");
+        if (error)
+            g_error_free(error);
+        return X11SPICE_ERR_GSTREAMER;
+    }
+
+    stream->src = gst_bin_get_by_name(GST_BIN(stream->pipeline), "src");
+    stream->sink = gst_bin_get_by_name(GST_BIN(stream->pipeline), "sink");
+    stream->encoder = gst_bin_get_by_name(GST_BIN(stream->pipeline), "enc");
+
+    desc = g_strdup_printf("video/x-raw,format=BGRx,width=%d,height=%d,framerate=0/1",
+                           width, height);
+    caps = gst_caps_from_string(desc);
+    g_free(desc);
+    gst_app_src_set_caps(GST_APP_SRC(stream->src), caps);
+    gst_caps_unref(caps);
+
+    stream->pipeline_codec = codec;
+    stream->width = width;
+    stream->height = height;
+    stream->fps = STREAM_MAX_FPS;
+    stream->bitrate = stream->max_bitrate / 2;
+    stream->last_frame = 0;
+    stream->last_adapt = g_get_monotonic_time();
+    stream->frames = stream->skipped = 0;
+    stream->bytes = 0;
+    set_bitrate(stream);
+
+    gst_element_set_state(stream->pipeline, GST_STATE_PLAYING);
+
+    memset(&format, 0, sizeof(format));
+    format.width = GUINT32_TO_LE(width);
+    format.height = GUINT32_TO_LE(height);
+    format.codec = codec;
+    queue_message(stream, STREAM_TYPE_FORMAT, &format, sizeof(format));
+
+    /* The first frame must show the whole screen */
+    stream->dirty = TRUE;
+
+    g_debug("video stream started: %dx%d, codec %d", width, height, codec);
+    return 0;
+}
+
+/*----------------------------------------------------------------------------
+**  Adapt to the network.  spice reads from us only as fast as the client
+**   takes the data, so the bytes still waiting for spice tell us whether
+**   we are sending too much.  More than a quarter second's worth backs
+**   us off quickly; an empty queue for a while lets us creep back up.
+**--------------------------------------------------------------------------*/
+static int adapt(stream_t *stream, gint64 now)
+{
+    int backlog = stream_backlog(stream);
+    int per_second = stream->bitrate * 1000 / 8;
+
+    if (backlog > per_second * 2)
+        return 0;
+
+    if (backlog > per_second / 4 && now - stream->last_adapt >= STREAM_ADAPT_USEC) {
+        stream->bitrate = MAX(STREAM_MIN_BITRATE, stream->bitrate * 3 / 4);
+        stream->fps = MAX(STREAM_MIN_FPS, stream->fps - 5);
+        stream->last_adapt = now;
+        set_bitrate(stream);
+    }
+    else if (backlog < per_second / 32 && now - stream->last_adapt >= STREAM_GROW_USEC &&
+             (stream->bitrate < stream->max_bitrate || stream->fps < STREAM_MAX_FPS)) {
+        stream->bitrate = MIN(stream->max_bitrate, stream->bitrate * 5 / 4);
+        stream->fps = MIN(STREAM_MAX_FPS, stream->fps + 2);
+        stream->last_adapt = now;
+        set_bitrate(stream);
+    }
+
+    return 1;
+}
+
+static void encode_frame(stream_t *stream, shm_image_t *shmi)
+{
+    GstBuffer *buffer;
+    GstMapInfo map;
+    int row_bytes = stream->width * sizeof(uint32_t);
+    int y;
+
+    buffer = gst_buffer_new_allocate(NULL, stream->height * row_bytes, NULL);
+    if (!buffer || !gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
+        g_debug("Unexpected failure to allocate a video frame");
+        return;
+    }
+
+    for (y = 0; y < stream->height; y++)
+        memcpy(map.data + y * row_bytes, (uint8_t *) shmi->shmaddr + y * shmi->bytes_per_line,
+               row_bytes);
+    gst_buffer_unmap(buffer, &map);
+
+    /* appsrc takes ownership of the buffer */
+    if (gst_app_src_push_buffer(GST_APP_SRC(stream->src), buffer) != GST_FLOW_OK)
+        g_debug("video encoder refused a frame");
+}
+
+static void collect_output(stream_t *stream)
+{
+    GstSample *sample;
+    GstBuffer *buffer;
+    GstMapInfo map;
+
+    while ((sample = gst_app_sink_try_pull_sample(GST_APP_SINK(stream->sink), 0))) {
+        buffer = gst_sample_get_buffer(sample);
+        if (buffer && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+            queue_message(stream, STREAM_TYPE_DATA, map.data, map.size);
+            stream->bytes += map.size;
+            gst_buffer_unmap(buffer, &map);
+        }
+        gst_sample_unref(sample);
+    }
+}
+
+/*----------------------------------------------------------------------------
+**  Called by the scanner on each pass with the mirror of the screen;
+**   starts and stops the encoder as the client asks, and encodes a frame
+**   whenever the screen has changed and the frame rate allows.
+**--------------------------------------------------------------------------*/
+void stream_update(stream_t *stream, shm_image_t *shmi)
+{
+    int codec = g_atomic_int_get(&stream->codec);
+    int width = shmi->w & ~1;
+    int height = shmi->h & ~1;
+    gint64 now;
+
+    if (!stream->enabled)
+        return;
+
+    if (stream->pipeline &&
+        (codec != stream->pipeline_codec || width != stream->width || height != stream->height))
+        destroy_pipeline(stream);
+
+    if (!stream->pipeline && codec)
+        if (create_pipeline(stream, codec, width, height))
+            g_atomic_int_set(&stream->codec, 0);
+
+    if (!stream->pipeline)
+        return;
+
+    now = g_get_monotonic_time();
+    if (stream->dirty && now - stream->last_frame >= G_USEC_PER_SEC / stream->fps) {
+        if (adapt(stream, now)) {
+            encode_frame(stream, shmi);
+            stream->frames++;
+            stream->dirty = FALSE;
+        }
+        else
+            stream->skipped++;
+        stream->last_frame = now;
+    }
+
+    collect_output(stream);
+}
+
+int stream_active(stream_t *stream)
+{
+    return stream->pipeline != NULL;
+}
+
+int stream_start(spice_t *spice, options_t *options, stream_t *stream)
+{
+    GstElementFactory *factory;
+    unsigned int i;
+    int rc;
+
+    static const SpiceCharDeviceInterface stream_sif = {
+        .base = {
+                 .type = SPICE_INTERFACE_CHAR_DEVICE,
+                 .description = "x11spice video stream",
+                 .major_version = SPICE_INTERFACE_CHAR_DEVICE_MAJOR,
+                 .minor_version = SPICE_INTERFACE_CHAR_DEVICE_MINOR,
+                 },
+        .state = stream_char_state,
+        .write = stream_char_write,
+        .read = stream_char_read,
+    };
+
+    memset(stream, 0, sizeof(*stream));
+    stream->spice = spice;
+    stream->notify_fd[0] = stream->notify_fd[1] = -1;
+    stream->base.base.sif = &stream_sif.base;
+    stream->base.subtype = "port";
+    stream->base.portname = STREAM_PORT_NAME;
+    stream->max_bitrate = options->stream_max_bitrate;
+
+    if (!options->stream)
+        return 0;
+
+    gst_init(NULL, NULL);
+    for (i = 0; i < sizeof(stream_codecs) / sizeof(stream_codecs[0]); i++) {
+        if (!(spice->video_codecs_allowed & (1 << stream_codecs[i].codec)))
+            continue;
+        factory = gst_element_factory_find(stream_codecs[i].factory);
+        if (factory) {
+            stream->codecs |= 1 << stream_codecs[i].codec;
+            gst_object_unref(factory);
+        }
+    }
+    if (!stream->codecs) {
+        g_warning("No usable GStreamer video encoder found; video streaming is disabled");
+        return X11SPICE_ERR_GSTREAMER;
+    }
+
+    rc = pipe(stream->notify_fd);
+    if (rc) {
+        perror("Error creating stream notify pipe");
+        return X11SPICE_ERR_GSTREAMER;
+    }
+    for (i = 0; i < 2; i++)
+        fcntl(stream->notify_fd[i], F_SETFL, O_NONBLOCK);
+
+    stream->lock = g_mutex_new();
+    stream->out = g_byte_array_new();
+    stream->in = g_byte_array_new();
+    stream->notify_watch = spice->core->watch_add(stream->notify_fd[0], SPICE_WATCH_EVENT_READ,
+                                                  notify_read, stream);
+
+    spice_server_add_interface(spice->server, &stream->base.base);
+    spice_server_port_event(&stream->base, SPICE_PORT_EVENT_OPENED);
+    stream->enabled = TRUE;
+
+    return 0;
+}
+
+void stream_stop(stream_t *stream)
+{
+    if (!stream->enabled)
+        return;
+
+    destroy_pipeline(stream);
+    spice_server_remove_interface(&stream->base.base);
+
+    if (stream->notify_watch)
+        stream->spice->core->watch_remove(stream->notify_watch);
+    stream->notify_watch = NULL;
+    close(stream->notify_fd[0]);
+    close(stream->notify_fd[1]);
+    stream->notify_fd[0] = stream->notify_fd[1] = -1;
+
+    g_byte_array_free(stream->out, TRUE);
+    g_byte_array_free(stream->in, TRUE);
+    g_mutex_free(stream->lock);
+    stream->enabled = FALSE;
+}
+
+#else
+
+int stream_start(spice_t *spice G_GNUC_UNUSED, options_t *options, stream_t *stream)
+{
+    memset(stream, 0, sizeof(*stream));
+    if (options->stream) {
+        g_warning("x11spice was built without GStreamer; video streaming is not available");
+        return X11SPICE_ERR_GSTREAMER;
+    }
+    return 0;
+}
+
+void stream_stop(stream_t *stream G_GNUC_UNUSED)
+{
+}
+
+int stream_active(stream_t *stream G_GNUC_UNUSED)
+{
+    return 0;
+}
+
+void stream_update(stream_t *stream G_GNUC_UNUSED, shm_image_t *shmi G_GNUC_UNUSED)
+{
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include "local_spice.h"
+#include "options.h"
+#include "display.h"
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+#define STREAM_PORT_NAME            "org.spice-space.stream.0"
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct {
+    SpiceCharDeviceInstance base;
+    spice_t *spice;
+    int enabled;
+    int codecs;
+
+    /* Set by spice to the codec the client wants, or 0 to stop */
+    gint codec;
+
+    /* Messages for spice, and the pipe that wakes it to read them */
+    GMutex *lock;
+    GByteArray *out;
+    GByteArray *in;
+    int notify_fd[2];
+    SpiceWatch *notify_watch;
+
+    /* The rest belongs to the scanner thread */
+    void *pipeline;
+    void *src;
+    void *sink;
+    void *encoder;
+    int pipeline_codec;
+    int width;
+    int height;
+    int dirty;
+
+    int fps;
+    int bitrate;
+    int max_bitrate;
+    gint64 last_frame;
+    gint64 last_adapt;
+
+    int frames;
+    int skipped;
+    gint64 bytes;
+} stream_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+int stream_start(spice_t *spice, options_t *options, stream_t *stream);
+void stream_stop(stream_t *stream);
+int stream_active(stream_t *stream);
+void stream_update(stream_t *stream, shm_image_t *shmi);
+
+#endif
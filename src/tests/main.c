@@ -35,6 +35,12 @@ int main(int argc, char *argv[])
 
     g_test_add("/x11spice/resize", xdummy_t, "resize", start_server, test_resize, stop_server);
 
+    g_test_add("/x11spice/scroll", xdummy_t, "scroll", start_server, test_scroll, stop_server);
+
+    g_test_add("/x11spice/move", xdummy_t, "move", start_server, test_move, stop_server);
+
+    g_test_add("/x11spice/fill", xdummy_t, "fill", start_server, test_fill, stop_server);
+
     g_test_add("/x11spice/x11perf1", xdummy_t, "x11perf1", start_server, test_script, stop_server);
 
     g_log_set_always_fatal(G_LOG_LEVEL_ERROR);
@@ -0,0 +1,158 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  pool_test.c
+**      Unit tests for the object pools in ../pool.c.  The concurrent case
+**  allocates on one thread and frees on another, as the scanner and the
+**  spice worker do.
+**--------------------------------------------------------------------------*/
+
+#include <glib.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define ITEM_SIZE                   64
+#define CONCURRENT_ITEMS            200000
+#define CONCURRENT_MAX_FREE         32
+
+static void test_reuse(void)
+{
+    pool_t pool;
+    void *a;
+    void *b;
+
+    pool_create(&pool, "test", ITEM_SIZE, 4);
+
+    a = pool_alloc(&pool);
+    g_assert(a != NULL);
+    memset(a, 0xff, ITEM_SIZE);
+    pool_free(&pool, a);
+    g_assert_cmpint(pool.cached, ==, 1);
+
+    /* A freed item comes back, and pool_alloc0 clears it */
+    b = pool_alloc0(&pool);
+    g_assert(b == a);
+    g_assert_cmpint(((unsigned char *) b)[ITEM_SIZE - 1], ==, 0);
+    g_assert_cmpint(pool.allocs, ==, 2);
+    g_assert_cmpint(pool.hits, ==, 1);
+    g_assert_cmpint(pool.live, ==, 1);
+    g_assert_cmpint(pool.cached, ==, 0);
+
+    pool_free(&pool, b);
+    pool_free(&pool, NULL);
+    g_assert_cmpint(pool.live, ==, 0);
+
+    pool_destroy(&pool);
+    g_assert(pool.lock == NULL);
+}
+
+static void test_max_free(void)
+{
+    pool_t pool;
+    void *items[8];
+    int i;
+
+    pool_create(&pool, "test", ITEM_SIZE, 2);
+    for (i = 0; i < 8; i++)
+        items[i] = pool_alloc(&pool);
+    for (i = 0; i < 8; i++)
+        pool_free(&pool, items[i]);
+
+    /* Only max_free are kept; the rest went back to free() */
+    g_assert_cmpint(pool.cached, ==, 2);
+    g_assert_cmpint(pool.live, ==, 0);
+
+    for (i = 0; i < 3; i++)
+        items[i] = pool_alloc(&pool);
+    g_assert_cmpint(pool.hits, ==, 2);
+    for (i = 0; i < 3; i++)
+        pool_free(&pool, items[i]);
+
+    pool_destroy(&pool);
+}
+
+/*----------------------------------------------------------------------------
+**  The allocating thread stamps each item, and hands it over through a
+**   GAsyncQueue; the freeing thread checks the stamp is intact, which it
+**   would not be if the pool ever handed out one item twice.
+**--------------------------------------------------------------------------*/
+typedef struct {
+    pool_t pool;
+    GAsyncQueue *queue;
+} concurrent_t;
+
+static void *free_thread(void *opaque)
+{
+    concurrent_t *c = (concurrent_t *) opaque;
+    int *item;
+    int i;
+
+    for (i = 1; i <= CONCURRENT_ITEMS; i++) {
+        item = g_async_queue_pop(c->queue);
+        g_assert_cmpint(item[0], ==, i);
+        g_assert_cmpint(item[ITEM_SIZE / sizeof(int) - 1], ==, -i);
+        item[0] = 0;
+        pool_free(&c->pool, item);
+    }
+
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    concurrent_t c;
+    pthread_t thread;
+    int *item;
+    int i;
+
+    pool_create(&c.pool, "test", ITEM_SIZE, CONCURRENT_MAX_FREE);
+    c.queue = g_async_queue_new();
+    g_assert_cmpint(pthread_create(&thread, NULL, free_thread, &c), ==, 0);
+
+    for (i = 1; i <= CONCURRENT_ITEMS; i++) {
+        item = pool_alloc(&c.pool);
+        g_assert(item != NULL);
+        item[0] = i;
+        item[ITEM_SIZE / sizeof(int) - 1] = -i;
+        g_async_queue_push(c.queue, item);
+    }
+    pthread_join(thread, NULL);
+
+    g_assert_cmpint(c.pool.allocs, ==, CONCURRENT_ITEMS);
+    g_assert_cmpint(c.pool.live, ==, 0);
+    g_assert_cmpint(c.pool.cached, <=, CONCURRENT_MAX_FREE);
+
+    g_async_queue_unref(c.queue);
+    pool_destroy(&c.pool);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/pool/reuse", test_reuse);
+    g_test_add_func("/pool/max_free", test_max_free);
+    g_test_add_func("/pool/concurrent", test_concurrent);
+
+    return g_test_run();
+}
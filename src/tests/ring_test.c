@@ -0,0 +1,290 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  ring_test.c
+**      Unit tests for the lock free ring in ../ring.c.  These need no X
+**  server; the concurrent cases run real threads against one ring, in the
+**  same roles the scanner and the spice worker play.
+**--------------------------------------------------------------------------*/
+
+#include <glib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "x11spice.h"
+#include "ring.h"
+
+#define CONCURRENT_ITEMS            200000
+#define CONCURRENT_RING_SIZE        64
+#define CONCURRENT_CONSUMERS        2
+#define STEAL_INTERVAL              16
+
+static void test_empty(void)
+{
+    ring_t ring;
+
+    g_assert_cmpint(ring_create(&ring, 3), ==, X11SPICE_ERR_BADARGS);
+    g_assert_cmpint(ring_create(&ring, 4), ==, 0);
+    g_assert(ring_pop(&ring) == NULL);
+    g_assert_cmpint(ring_length(&ring), ==, 0);
+
+    g_assert(ring_push(&ring, GINT_TO_POINTER(1)));
+    g_assert(ring_pop(&ring) == GINT_TO_POINTER(1));
+    g_assert(ring_pop(&ring) == NULL);
+    g_assert_cmpint(ring_length(&ring), ==, 0);
+
+    ring_destroy(&ring, NULL);
+}
+
+static void test_full(void)
+{
+    ring_t ring;
+    int i;
+
+    g_assert_cmpint(ring_create(&ring, 4), ==, 0);
+    for (i = 1; i <= 4; i++)
+        g_assert(ring_push(&ring, GINT_TO_POINTER(i)));
+    g_assert(!ring_push(&ring, GINT_TO_POINTER(5)));
+    g_assert_cmpint(ring_length(&ring), ==, 4);
+
+    /* One pop makes room for exactly one more */
+    g_assert(ring_pop(&ring) == GINT_TO_POINTER(1));
+    g_assert(ring_push(&ring, GINT_TO_POINTER(5)));
+    g_assert(!ring_push(&ring, GINT_TO_POINTER(6)));
+
+    for (i = 2; i <= 5; i++)
+        g_assert(ring_pop(&ring) == GINT_TO_POINTER(i));
+    g_assert(ring_pop(&ring) == NULL);
+
+    ring_destroy(&ring, NULL);
+}
+
+/* Start the positions just short of where the sequence numbers wrap */
+static void ring_set_position(ring_t *ring, guint pos)
+{
+    guint i;
+
+    for (i = 0; i <= ring->mask; i++)
+        ring->cells[(pos + i) & ring->mask].seq = (gint) (pos + i);
+    ring->head = (gint) pos;
+    ring->tail = (gint) pos;
+}
+
+static void test_wraparound(void)
+{
+    ring_t ring;
+    int next_push = 1;
+    int next_pop = 1;
+    int round;
+    int i;
+
+    g_assert_cmpint(ring_create(&ring, 8), ==, 0);
+    ring_set_position(&ring, G_MAXUINT - 20);
+
+    /* Uneven batches walk the positions around the cells, and the
+       sequence numbers through G_MAXINT and G_MAXUINT */
+    for (round = 0; round < 100; round++) {
+        for (i = 0; i < 1 + round % 8 && next_push - next_pop < 8; i++)
+            g_assert(ring_push(&ring, GINT_TO_POINTER(next_push++)));
+        if (next_push - next_pop == 8)
+            g_assert(!ring_push(&ring, GINT_TO_POINTER(next_push)));
+        g_assert_cmpint(ring_length(&ring), ==, next_push - next_pop);
+        for (i = 0; i < 1 + (round + 3) % 8 && next_pop < next_push; i++)
+            g_assert(ring_pop(&ring) == GINT_TO_POINTER(next_pop++));
+    }
+    while (next_pop < next_push)
+        g_assert(ring_pop(&ring) == GINT_TO_POINTER(next_pop++));
+    g_assert(ring_pop(&ring) == NULL);
+
+    ring_destroy(&ring, NULL);
+}
+
+static int freed;
+
+static void count_free(gpointer data G_GNUC_UNUSED)
+{
+    g_atomic_int_inc(&freed);
+}
+
+static gboolean rect_inside(const ring_rect_t *inner, gpointer user_data)
+{
+    ring_rect_t *outer = (ring_rect_t *) user_data;
+
+    return inner->left >= outer->left && inner->right <= outer->right &&
+        inner->top >= outer->top && inner->bottom <= outer->bottom;
+}
+
+static void push_at(ring_t *ring, int i)
+{
+    ring_rect_t rect;
+
+    rect.left = i;
+    rect.top = 0;
+    rect.right = i + 1;
+    rect.bottom = 1;
+    g_assert(ring_push_rect(ring, GINT_TO_POINTER(i), &rect));
+}
+
+static void test_steal(void)
+{
+    ring_t ring;
+    ring_rect_t outer = { 2, 0, 6, 1 };
+    gint from;
+    int i;
+
+    g_assert_cmpint(ring_create(&ring, 16), ==, 0);
+    for (i = 1; i <= 4; i++)
+        push_at(&ring, i);
+    from = ring_position(&ring);
+    for (i = 5; i <= 8; i++)
+        push_at(&ring, i);
+
+    /* Items 2 to 5 are inside, but only 5 is at or after 'from' */
+    freed = 0;
+    g_assert_cmpint(ring_steal_matching(&ring, from, rect_inside, &outer, count_free), ==, 1);
+    g_assert_cmpint(freed, ==, 1);
+
+    /* From the tail, 2 to 4 go too */
+    g_assert(ring_pop(&ring) == GINT_TO_POINTER(1));
+    g_assert_cmpint(ring_steal_matching(&ring, 0, rect_inside, &outer, count_free), ==, 3);
+    g_assert_cmpint(freed, ==, 4);
+
+    /* The emptied cells are skipped over, and are free to reuse */
+    for (i = 6; i <= 8; i++)
+        g_assert(ring_pop(&ring) == GINT_TO_POINTER(i));
+    g_assert(ring_pop(&ring) == NULL);
+    for (i = 0; i < 16; i++)
+        push_at(&ring, i + 100);
+    g_assert(!ring_push(&ring, GINT_TO_POINTER(1)));
+
+    ring_destroy(&ring, count_free);
+    g_assert_cmpint(freed, ==, 20);
+}
+
+/*----------------------------------------------------------------------------
+**  One producer, which also steals, as the scanner does, against several
+**   consumers.  Every item must come out exactly once, either popped or
+**   stolen, and each consumer must see the items in the order pushed.
+**--------------------------------------------------------------------------*/
+typedef struct {
+    ring_t ring;
+    gint done;
+    gint popped;
+    gint64 popped_sum;
+    GMutex *lock;
+} concurrent_t;
+
+static gint64 stolen_sum;
+
+static void sum_free(gpointer data)
+{
+    stolen_sum += GPOINTER_TO_INT(data);
+    freed++;
+}
+
+static gboolean rect_is_odd(const ring_rect_t *rect, gpointer user_data G_GNUC_UNUSED)
+{
+    return rect->left % 2 == 1;
+}
+
+static void *consumer(void *opaque)
+{
+    concurrent_t *c = (concurrent_t *) opaque;
+    gint64 sum = 0;
+    int count = 0;
+    int last = 0;
+    gpointer data;
+
+    while (1) {
+        data = ring_pop(&c->ring);
+        if (!data) {
+            if (g_atomic_int_get(&c->done) && ring_length(&c->ring) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+        g_assert_cmpint(GPOINTER_TO_INT(data), >, last);
+        last = GPOINTER_TO_INT(data);
+        sum += last;
+        count++;
+    }
+
+    g_mutex_lock(c->lock);
+    c->popped += count;
+    c->popped_sum += sum;
+    g_mutex_unlock(c->lock);
+
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    concurrent_t c;
+    pthread_t threads[CONCURRENT_CONSUMERS];
+    ring_rect_t rect;
+    int i;
+
+    g_assert_cmpint(ring_create(&c.ring, CONCURRENT_RING_SIZE), ==, 0);
+    c.done = FALSE;
+    c.popped = 0;
+    c.popped_sum = 0;
+    c.lock = g_mutex_new();
+    freed = 0;
+    stolen_sum = 0;
+
+    for (i = 0; i < CONCURRENT_CONSUMERS; i++)
+        g_assert_cmpint(pthread_create(&threads[i], NULL, consumer, &c), ==, 0);
+
+    for (i = 1; i <= CONCURRENT_ITEMS; i++) {
+        rect.left = i;
+        rect.top = 0;
+        rect.right = i + 1;
+        rect.bottom = 1;
+        while (!ring_push_rect(&c.ring, GINT_TO_POINTER(i), &rect))
+            sched_yield();
+        if (i % STEAL_INTERVAL == 0)
+            ring_steal_matching(&c.ring, 0, rect_is_odd, NULL, sum_free);
+    }
+    g_atomic_int_set(&c.done, TRUE);
+
+    for (i = 0; i < CONCURRENT_CONSUMERS; i++)
+        pthread_join(threads[i], NULL);
+
+    g_assert(ring_pop(&c.ring) == NULL);
+    g_assert_cmpint(c.popped + freed, ==, CONCURRENT_ITEMS);
+    g_assert(c.popped_sum + stolen_sum == (gint64) CONCURRENT_ITEMS * (CONCURRENT_ITEMS + 1) / 2);
+
+    g_mutex_free(c.lock);
+    ring_destroy(&c.ring, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/ring/empty", test_empty);
+    g_test_add_func("/ring/full", test_full);
+    g_test_add_func("/ring/wraparound", test_wraparound);
+    g_test_add_func("/ring/steal", test_steal);
+    g_test_add_func("/ring/concurrent", test_concurrent);
+
+    return g_test_run();
+}
@@ -88,8 +88,7 @@ static int check_binary(char *exe, char *display)
     return rc;
 }
 
-static void check_screenshot(test_t *test, x11spice_server_t *spice_server, xdummy_t *xdummy,
-                             gchar *expected_result)
+static gchar *take_screenshot(test_t *test, x11spice_server_t *spice_server)
 {
     int needs_prefix = 1;
     gchar *screencap;
@@ -109,6 +108,17 @@ static void check_screenshot(test_t *test, x11spice_server_t *spice_server, xdum
              needs_prefix ? "spice://" : "", spice_server->uri, screencap);
     system(buf);
 
+    return screencap;
+}
+
+static void check_screenshot(test_t *test, x11spice_server_t *spice_server, xdummy_t *xdummy,
+                             gchar *expected_result)
+{
+    gchar *screencap;
+    char buf[4096];
+
+    screencap = take_screenshot(test, spice_server);
+
     snprintf(buf, sizeof(buf), "md5sum %s | "
              "sed -e 's!%s!%s!' |" "md5sum -c", expected_result, expected_result, screencap);
     if (system(buf)) {
@@ -123,6 +133,39 @@ static void check_screenshot(test_t *test, x11spice_server_t *spice_server, xdum
     g_free(screencap);
 }
 
+/*----------------------------------------------------------------------------
+**  What the client shows should match the X screen exactly.  This needs
+**   no expected image, so it suits tests whose drawing depends on the
+**   screen size, or that we simply want to compare after each step.
+**--------------------------------------------------------------------------*/
+static void check_screen_matches(test_t *test, x11spice_server_t *spice_server,
+                                 xdummy_t *xdummy, const char *step)
+{
+    gchar *screencap;
+    char buf[4096];
+    int differ;
+
+    /* Give x11spice time to catch up with the last of the drawing */
+    sleep(1);
+
+    screencap = take_screenshot(test, spice_server);
+    snprintf(buf, sizeof(buf), ":%s", xdummy->display);
+    differ = xcb_screen_matches(buf, screencap);
+    if (differ) {
+        snprintf(buf, sizeof(buf), "xwd -display :%s -root -out %s.xwd",
+                 xdummy->display, screencap);
+        system(buf);
+
+        if (differ < 0)
+            g_warning("%s: could not compare %s with the screen", step, screencap);
+        else
+            g_warning("%s: %d pixels of %s differ from the screen", step, differ, screencap);
+        g_warning("xwud -in %s.xwd should show you the current X screen.", screencap);
+        g_test_fail();
+    }
+    g_free(screencap);
+}
+
 void test_basic(xdummy_t *xdummy, gconstpointer user_data)
 {
     test_t test;
@@ -183,6 +226,100 @@ void test_resize(xdummy_t *xdummy, gconstpointer user_data)
     test_common_stop(&test, &server);
 }
 
+/* A terminal that scrolls should come through as COPY_BITS */
+void test_scroll(xdummy_t *xdummy, gconstpointer user_data)
+{
+    test_t test;
+    x11spice_server_t server;
+    int rc;
+    char buf[4096];
+
+    if (check_binary("spicy-screenshot", NULL))
+        return;
+
+    rc = test_common_start(&test, &server, xdummy, user_data);
+    if (rc)
+        return;
+
+    snprintf(buf, sizeof(buf), ":%s", xdummy->display);
+    if (xcb_scroll_terminal(buf, 32, 32, 80, 24, 1)) {
+        g_warning("Could not draw the terminal");
+        g_test_fail();
+    }
+    else {
+        check_screen_matches(&test, &server, xdummy, "one line");
+        xcb_scroll_terminal(buf, 32, 32, 80, 24, 40);
+        check_screen_matches(&test, &server, xdummy, "forty lines");
+    }
+
+    test_common_stop(&test, &server);
+}
+
+/* A window moving should come through as COPY_BITS, with what it
+   uncovered sent after */
+void test_move(xdummy_t *xdummy, gconstpointer user_data)
+{
+    test_t test;
+    x11spice_server_t server;
+    xcb_test_window_t *win;
+    int rc;
+    int i;
+    char buf[4096];
+
+    if (check_binary("spicy-screenshot", NULL))
+        return;
+
+    rc = test_common_start(&test, &server, xdummy, user_data);
+    if (rc)
+        return;
+
+    snprintf(buf, sizeof(buf), ":%s", xdummy->display);
+    xcb_draw_grid(buf);
+    win = xcb_create_test_window(buf, 100, 100, 320, 240);
+    if (!win) {
+        g_warning("Could not create the window");
+        g_test_fail();
+    }
+    else {
+        check_screen_matches(&test, &server, xdummy, "mapped");
+        for (i = 1; i <= 20; i++) {
+            xcb_move_test_window(win, 100 + i * 13, 100 + i * 7);
+            usleep(20 * 1000);
+        }
+        check_screen_matches(&test, &server, xdummy, "moved");
+        xcb_destroy_test_window(win);
+    }
+
+    test_common_stop(&test, &server);
+}
+
+/* Solid areas should come through as fills, without losing what is
+   beside them or a single pixel inside them */
+void test_fill(xdummy_t *xdummy, gconstpointer user_data)
+{
+    test_t test;
+    x11spice_server_t server;
+    int rc;
+    char buf[4096];
+
+    if (check_binary("spicy-screenshot", NULL))
+        return;
+
+    rc = test_common_start(&test, &server, xdummy, user_data);
+    if (rc)
+        return;
+
+    snprintf(buf, sizeof(buf), ":%s", xdummy->display);
+    if (xcb_draw_fills(buf)) {
+        g_warning("Could not draw the fills");
+        g_test_fail();
+    }
+    else
+        check_screen_matches(&test, &server, xdummy, "fills");
+
+    test_common_stop(&test, &server);
+}
+
 /*
 **  The 'script' type test is a special case.
 **  It is set up to allow us to run any shell script we like.
@@ -42,6 +42,9 @@ typedef struct
 **--------------------------------------------------------------------------*/
 void test_basic(xdummy_t *server, gconstpointer user_data);
 void test_resize(xdummy_t *server, gconstpointer user_data);
+void test_scroll(xdummy_t *server, gconstpointer user_data);
+void test_move(xdummy_t *server, gconstpointer user_data);
+void test_fill(xdummy_t *server, gconstpointer user_data);
 void test_script(xdummy_t *xdummy, gconstpointer user_data);
 
 #endif
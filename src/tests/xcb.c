@@ -22,9 +22,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <xcb/xcb.h>
 
+#include "xcb.h"
+
 
 static void lookup_color(xcb_connection_t *c, xcb_screen_t *screen, const char *color,
                          uint32_t *pixel)
@@ -117,3 +120,261 @@ int xcb_draw_grid(const char *display)
 
     return 0;
 }
+
+/*----------------------------------------------------------------------------
+**  Drawing for the tests of the ways x11spice sends particular kinds of
+**   update.  xcb_screen_matches then checks what the client shows
+**   against what the X server really has, so no expected image is
+**   needed.
+**  We draw fake text, rows of small blocks, rather than use a font, so
+**   the tests do not depend on which fonts are installed.
+**--------------------------------------------------------------------------*/
+#define LINE_HEIGHT     16
+#define GLYPH_WIDTH     8
+#define MAX_GLYPHS      256
+
+struct xcb_test_window {
+    xcb_connection_t *c;
+    xcb_window_t window;
+};
+
+static xcb_gcontext_t create_gc(xcb_connection_t *c, xcb_screen_t *screen, const char *color)
+{
+    xcb_gcontext_t gc = xcb_generate_id(c);
+    uint32_t values[2];
+
+    lookup_color(c, screen, color, &values[0]);
+    values[1] = 0;
+    xcb_create_gc(c, gc, screen->root, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES, values);
+
+    return gc;
+}
+
+static void sync_with_server(xcb_connection_t *c)
+{
+    free(xcb_get_input_focus_reply(c, xcb_get_input_focus(c), NULL));
+}
+
+static void draw_text_line(xcb_connection_t *c, xcb_drawable_t d, xcb_gcontext_t fg,
+                           int x, int y, int w, int line)
+{
+    xcb_rectangle_t glyphs[MAX_GLYPHS];
+    uint32_t bits = line * 2654435761u;
+    int count = 0;
+    int i;
+
+    for (i = 0; i + GLYPH_WIDTH <= w && count < MAX_GLYPHS; i += GLYPH_WIDTH) {
+        bits = bits * 1103515245 + 12345;
+        if ((bits >> 16) % 4 == 0)
+            continue;
+        glyphs[count].x = x + i + 1;
+        glyphs[count].y = y + 2 + (bits >> 20) % 4;
+        glyphs[count].width = 2 + (bits >> 24) % 5;
+        glyphs[count].height = LINE_HEIGHT - 6 - (bits >> 20) % 4;
+        count++;
+    }
+    xcb_poly_fill_rectangle(c, d, fg, count, glyphs);
+}
+
+/* Draw a terminal on the root window, then scroll it the way a terminal
+   does:  copy the lines up one, and draw a new last line */
+int xcb_scroll_terminal(const char *display, int x, int y, int columns, int rows, int scrolls)
+{
+    xcb_connection_t *c;
+    xcb_screen_t *screen;
+    xcb_gcontext_t fg;
+    xcb_gcontext_t bg;
+    xcb_rectangle_t area;
+    int w = columns * GLYPH_WIDTH;
+    int i;
+
+    c = xcb_connect(display, NULL);
+    if (xcb_connection_has_error(c))
+        return 1;
+    screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+
+    fg = create_gc(c, screen, "white");
+    bg = create_gc(c, screen, "black");
+
+    area.x = x;
+    area.y = y;
+    area.width = w;
+    area.height = rows * LINE_HEIGHT;
+    xcb_poly_fill_rectangle(c, screen->root, bg, 1, &area);
+    for (i = 0; i < rows; i++)
+        draw_text_line(c, screen->root, fg, x, y + i * LINE_HEIGHT, w, i);
+    sync_with_server(c);
+
+    /* Let x11spice see the first page before it scrolls */
+    sleep(1);
+
+    area.y = y + (rows - 1) * LINE_HEIGHT;
+    area.height = LINE_HEIGHT;
+    for (i = 0; i < scrolls; i++) {
+        xcb_copy_area(c, screen->root, screen->root, fg, x, y + LINE_HEIGHT, x, y,
+                      w, (rows - 1) * LINE_HEIGHT);
+        xcb_poly_fill_rectangle(c, screen->root, bg, 1, &area);
+        draw_text_line(c, screen->root, fg, x, area.y, w, rows + i);
+        sync_with_server(c);
+        usleep(20 * 1000);
+    }
+
+    xcb_disconnect(c);
+
+    return 0;
+}
+
+/* A window full of text, left open until xcb_destroy_test_window */
+xcb_test_window_t *xcb_create_test_window(const char *display, int x, int y, int w, int h)
+{
+    xcb_test_window_t *win;
+    xcb_screen_t *screen;
+    xcb_gcontext_t fg;
+    uint32_t values[2];
+    int i;
+
+    win = calloc(1, sizeof(*win));
+    if (!win)
+        return NULL;
+
+    win->c = xcb_connect(display, NULL);
+    if (xcb_connection_has_error(win->c)) {
+        xcb_disconnect(win->c);
+        free(win);
+        return NULL;
+    }
+    screen = xcb_setup_roots_iterator(xcb_get_setup(win->c)).data;
+
+    /* No window manager runs here; override redirect says we need none */
+    win->window = xcb_generate_id(win->c);
+    values[0] = screen->black_pixel;
+    values[1] = 1;
+    xcb_create_window(win->c, XCB_COPY_FROM_PARENT, win->window, screen->root, x, y, w, h, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual,
+                      XCB_CW_BACK_PIXEL | XCB_CW_OVERRIDE_REDIRECT, values);
+    xcb_map_window(win->c, win->window);
+    sync_with_server(win->c);
+
+    fg = create_gc(win->c, screen, "yellow");
+    for (i = 0; i < h / LINE_HEIGHT; i++)
+        draw_text_line(win->c, win->window, fg, 0, i * LINE_HEIGHT, w, i);
+    sync_with_server(win->c);
+
+    return win;
+}
+
+void xcb_move_test_window(xcb_test_window_t *win, int x, int y)
+{
+    uint32_t values[2];
+
+    values[0] = x;
+    values[1] = y;
+    xcb_configure_window(win->c, win->window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, values);
+    sync_with_server(win->c);
+}
+
+void xcb_destroy_test_window(xcb_test_window_t *win)
+{
+    xcb_disconnect(win->c);
+    free(win);
+}
+
+/* Solid areas, a solid area with text beside it in the same rows, and a
+   single odd pixel inside a solid area, which must not be lost to a fill */
+int xcb_draw_fills(const char *display)
+{
+    static const char *colors[] = { "white", "blue", "gray50", "dark green" };
+    xcb_connection_t *c;
+    xcb_screen_t *screen;
+    xcb_gcontext_t gc;
+    xcb_gcontext_t fg;
+    xcb_rectangle_t r;
+    int w, h;
+    int i;
+
+    c = xcb_connect(display, NULL);
+    if (xcb_connection_has_error(c))
+        return 1;
+    screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+    w = screen->width_in_pixels;
+    h = screen->height_in_pixels;
+
+    for (i = 0; i < 4; i++) {
+        gc = create_gc(c, screen, colors[i]);
+        r.x = 0;
+        r.y = i * h / 4;
+        r.width = w;
+        r.height = h / 4;
+        xcb_poly_fill_rectangle(c, screen->root, gc, 1, &r);
+    }
+
+    fg = create_gc(c, screen, "black");
+    for (i = 0; i < 4; i++)
+        draw_text_line(c, screen->root, fg, 0, h / 4 + i * LINE_HEIGHT, w / 2, i);
+
+    gc = create_gc(c, screen, "red");
+    r.x = w / 2;
+    r.y = h / 8;
+    r.width = 1;
+    r.height = 1;
+    xcb_poly_fill_rectangle(c, screen->root, gc, 1, &r);
+
+    sync_with_server(c);
+    xcb_disconnect(c);
+
+    return 0;
+}
+
+/* Returns how many pixels of the P6 ppm differ from the screen, or -1 */
+int xcb_screen_matches(const char *display, const char *ppm)
+{
+    xcb_connection_t *c;
+    xcb_screen_t *screen;
+    xcb_get_image_reply_t *image;
+    unsigned char *rgb = NULL;
+    unsigned char *p;
+    FILE *fp;
+    int w, h, max;
+    int differ = -1;
+    int x, y;
+
+    fp = fopen(ppm, "rb");
+    if (!fp)
+        return -1;
+    if (fscanf(fp, "P6 %d %d %d", &w, &h, &max) != 3 || max != 255 || fgetc(fp) == EOF)
+        goto out;
+    rgb = malloc(w * h * 3);
+    if (!rgb || fread(rgb, 3, w * h, fp) != (size_t) (w * h))
+        goto out;
+
+    c = xcb_connect(display, NULL);
+    if (xcb_connection_has_error(c)) {
+        xcb_disconnect(c);
+        goto out;
+    }
+    screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+
+    if (w == screen->width_in_pixels && h == screen->height_in_pixels && screen->root_depth == 24) {
+        differ = 0;
+        for (y = 0; y < h; y++) {
+            image = xcb_get_image_reply(c, xcb_get_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                                                         screen->root, 0, y, w, 1, ~0), NULL);
+            if (!image) {
+                differ = -1;
+                break;
+            }
+            p = xcb_get_image_data(image);
+            for (x = 0; x < w; x++, p += 4)
+                if (p[2] != rgb[(y * w + x) * 3] || p[1] != rgb[(y * w + x) * 3 + 1] ||
+                    p[0] != rgb[(y * w + x) * 3 + 2])
+                    differ++;
+            free(image);
+        }
+    }
+    xcb_disconnect(c);
+
+out:
+    free(rgb);
+    fclose(fp);
+    return differ;
+}
@@ -22,9 +22,20 @@
 #define XCB_H_
 
 
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct xcb_test_window xcb_test_window_t;
+
 /*----------------------------------------------------------------------------
 **  Prototypes
 **--------------------------------------------------------------------------*/
 int xcb_draw_grid(const char *display);
+int xcb_scroll_terminal(const char *display, int x, int y, int columns, int rows, int scrolls);
+xcb_test_window_t *xcb_create_test_window(const char *display, int x, int y, int w, int h);
+void xcb_move_test_window(xcb_test_window_t *win, int x, int y);
+void xcb_destroy_test_window(xcb_test_window_t *win);
+int xcb_draw_fills(const char *display);
+int xcb_screen_matches(const char *display, const char *ppm);
 
 #endif
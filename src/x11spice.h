@@ -43,5 +43,6 @@
 #define X11SPICE_ERR_LISTEN            16
 #define X11SPICE_ERR_OPEN              17
 #define X11SPICE_ERR_NOAUDIT           18
+#define X11SPICE_ERR_GSTREAMER         19
 
 #endif